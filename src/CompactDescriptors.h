@@ -0,0 +1,91 @@
+#pragma once
+
+#include <opencv2\opencv.hpp>
+#include <vector>
+
+#include "Parallel.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+	Smaller versions of the 128 bytes SIFT descriptors, to keep more frames in memory
+	Both are trained on a sample of descriptors (rows of CV_8U, stacked from several frames)
+*/
+
+// projection on the main axes of the descriptors, quantized to 1 byte per axis
+// matched by squared euclidean distance, like the full descriptors
+struct DescriptorPCA {
+
+	PCA pca;
+	float scale = 1; // from projected values to bytes, the same for every axis to keep distances
+
+	void train(const Mat& samples, int dims = 32) {
+
+		Mat samplesF;
+		samples.convertTo(samplesF, CV_32F);
+		pca = PCA(samplesF, Mat(), PCA::DATA_AS_ROW, dims);
+
+		// 3 standard deviations of the main axis fit in [-127, 127]
+		float sigma = sqrt(pca.eigenvalues.at<float>(0));
+		scale = sigma > 0 ? 127 / (3 * sigma) : 1;
+	}
+
+	int dims() const { return pca.eigenvectors.rows; }
+
+	// one row of dims() bytes per descriptor
+	void project(const Mat& descriptors, Mat& compact) const {
+
+		Mat descF, projected;
+		descriptors.convertTo(descF, CV_32F);
+		pca.project(descF, projected);
+		projected.convertTo(compact, CV_8U, scale, 128); // saturated
+	}
+};
+
+// 2 bits per dimension (256 bits per descriptor) : a value below, between or above
+// 2 thresholds learned per dimension, coded as 00, 01 or 11
+// the hamming distance between 2 codes is the L1 distance between the quantized values
+struct DescriptorBinarizer {
+
+	Mat thresholds; // 2 rows of 128 values
+
+	void train(const Mat& samples) {
+
+		// thresholds at the 1/3 and 2/3 quantiles of each dimension
+		thresholds = Mat(2, samples.cols, CV_8U);
+		vector<uchar> values(samples.rows);
+		for (int j = 0; j < samples.cols; j++) {
+			for (int i = 0; i < samples.rows; i++) { values[i] = samples.at<uchar>(i, j); }
+			for (int t = 0; t < 2; t++) {
+				auto quantile = values.begin() + (t + 1) * values.size() / 3;
+				nth_element(values.begin(), quantile, values.end());
+				thresholds.at<uchar>(t, j) = quantile == values.end() ? 255 : *quantile;
+			}
+		}
+	}
+
+	int bytes() const { return thresholds.cols / 4; }
+
+	// one row of bytes() bytes per descriptor, matched with NORM_HAMMING
+	void binarize(const Mat& descriptors, Mat& codes) const {
+
+		codes = Mat(descriptors.rows, bytes(), CV_8U);
+		const uchar* t0 = thresholds.ptr<uchar>(0);
+		const uchar* t1 = thresholds.ptr<uchar>(1);
+
+		parallelFor(Range(0, descriptors.rows), [&](const Range& range) {
+			for (int i = range.start; i < range.end; i++) {
+				const uchar* desc = descriptors.ptr<uchar>(i);
+				uchar* code = codes.ptr<uchar>(i);
+				for (int b = 0; b < bytes(); b++) {
+					uchar byte = 0;
+					for (int j = 4 * b; j < 4 * b + 4; j++) {
+						byte = (byte << 2) | (desc[j] > t0[j] ? 1 : 0) | (desc[j] > t1[j] ? 2 : 0);
+					}
+					code[b] = byte;
+				}
+			}
+		});
+	}
+};
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <opencv2\opencv.hpp>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <memory>
+#include <cstdint>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "SIFT.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+	Persistent store of the keypoints and descriptors of images, so that
+	running the pipeline again on the same images skips the extraction
+	The results are keyed by a hash of the image content and of the detector parameters,
+	and appended to a single binary file, memory-mapped when the cache is opened :
+	the descriptors of a stored image are a Mat header over the mapping (no copy),
+	which keeps the mapping open while it is used, even after the cache is destroyed
+	Results computed during this session are kept in memory until the next opening
+*/
+struct FeatureCache {
+
+	// to change when the detector or the descriptor change
+	static const uint32_t version = 2;
+
+private:
+	static const uint32_t magic = 0x46464d53; // "SMFF"
+
+	struct RecordHeader {
+		uint32_t magic;
+		uint32_t nbPoints;
+		uint32_t descCols;
+		uint32_t padding;
+		uint64_t key;
+	};
+
+	// KeyPoint without any compiler dependent layout
+	struct PointRecord {
+		float x, y, size, angle, response;
+		int32_t octave, classId;
+	};
+
+	struct Entry {
+		vector<KeyPoint> keypoints;
+		Mat descriptors; // over the mapping for the entries of the file
+	};
+
+	// read only mapping of the file, unmapped with its last user
+	struct Mapping {
+		const uchar* data = NULL;
+		size_t size = 0;
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE, fileMapping = NULL;
+#endif
+
+		Mapping(const string& path) {
+#ifdef _WIN32
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+				NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (file == INVALID_HANDLE_VALUE) { return; } // new cache
+			LARGE_INTEGER fileSize;
+			GetFileSizeEx(file, &fileSize);
+			size = (size_t)fileSize.QuadPart;
+			if (size == 0) { return; }
+			fileMapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (fileMapping == NULL) { cerr << "Error, can't map " << path << endl; throw 1; }
+			data = (const uchar*)MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0) { return; } // new cache
+			struct stat st;
+			fstat(fd, &st);
+			size = (size_t)st.st_size;
+			if (size > 0) {
+				void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+				data = p == MAP_FAILED ? NULL : (const uchar*)p;
+			}
+			close(fd);
+#endif
+			if (size > 0 && data == NULL) { cerr << "Error, can't map " << path << endl; throw 1; }
+		}
+
+		Mapping(const Mapping&) = delete;
+		Mapping& operator=(const Mapping&) = delete;
+
+		~Mapping() {
+#ifdef _WIN32
+			if (data != NULL) { UnmapViewOfFile(data); }
+			if (fileMapping != NULL) { CloseHandle(fileMapping); }
+			if (file != INVALID_HANDLE_VALUE) { CloseHandle(file); }
+#else
+			if (data != NULL) { munmap((void*)data, size); }
+#endif
+		}
+	};
+
+	/*
+		Allocator of the Mat headers over the mapping : when the last Mat sharing one is released,
+		its UMatData is deleted here with the reference to the mapping it holds
+		(Mat::create on such a Mat falls back to the default allocator)
+	*/
+	struct MappingAllocator : MatAllocator {
+
+		UMatData* allocate(int dims, const int* sizes, int type,
+			void* data, size_t* step, int flags, UMatUsageFlags usageFlags) const {
+			return NULL;
+		}
+
+		bool allocate(UMatData* data, int accessFlags, UMatUsageFlags usageFlags) const { return false; }
+
+		void deallocate(UMatData* data) const {
+			delete (shared_ptr<Mapping>*)data->userdata;
+			delete data;
+		}
+
+		static const MappingAllocator* get() {
+			static MappingAllocator allocator;
+			return &allocator;
+		}
+	};
+
+	string path;
+	unordered_map<uint64_t, Entry> entries;
+	shared_ptr<Mapping> mapping;
+	uint64_t validSize = 0; // end of the last complete record of the file
+
+public:
+	FeatureCache(const string& path) : path(path), mapping(make_shared<Mapping>(path)) {
+		load();
+	}
+
+	FeatureCache(const FeatureCache&) = delete;
+	FeatureCache& operator=(const FeatureCache&) = delete;
+
+	size_t size() const { return entries.size(); }
+
+	// hash of the image content and of the parameters changing the result of the detection
+	static uint64_t key(const Mat& image, const SIFT& sift) {
+
+		// FNV-1a
+		uint64_t hash = 14695981039346656037ULL;
+		auto add = [&](const void* data, size_t size) {
+			const uchar* bytes = (const uchar*)data;
+			for (size_t i = 0; i < size; i++) {
+				hash ^= bytes[i];
+				hash *= 1099511628211ULL;
+			}
+		};
+		auto addValue = [&](auto value) { add(&value, sizeof(value)); };
+
+		addValue(version);
+		addValue(sift.sizePyramid);
+		addValue(sift.maxOctaves);
+		addValue(sift.maxPoints);
+		addValue(sift.borderSize);
+		addValue(sift.sigma);
+		addValue(sift.inputSigma);
+		addValue(sift.gridCols);
+		addValue(sift.gridRows);
+		addValue(sift.pointBudget);
+		addValue(sift.fixedPoint);
+
+		addValue(image.cols);
+		addValue(image.rows);
+		addValue(image.type());
+		size_t rowSize = image.cols * image.elemSize();
+		for (int y = 0; y < image.rows; y++) { add(image.ptr(y), rowSize); }
+		return hash;
+	}
+
+	// the descriptors are shared with the cache, and those of the file are over the
+	// read only mapping : they must not be modified (clone them to do so)
+	bool get(uint64_t key, vector<KeyPoint>& keypoints, Mat& descriptors) const {
+		auto it = entries.find(key);
+		if (it == entries.end()) { return false; }
+		keypoints = it->second.keypoints;
+		descriptors = it->second.descriptors;
+		return true;
+	}
+
+	// the descriptors are kept without a copy, and must not be modified afterwards
+	void put(uint64_t key, const vector<KeyPoint>& keypoints, const Mat& descriptors) {
+
+		if (entries.count(key) > 0) { return; }
+
+		RecordHeader header = { magic, (uint32_t)keypoints.size(), (uint32_t)descriptors.cols, 0, key };
+		vector<PointRecord> points(keypoints.size());
+		for (uint i = 0; i < keypoints.size(); i++) {
+			const KeyPoint& kp = keypoints[i];
+			points[i] = { kp.pt.x, kp.pt.y, kp.size, kp.angle, kp.response, kp.octave, kp.class_id };
+		}
+
+		// written after the last complete record (overwriting an interrupted one)
+		fstream out(path, ios::in | ios::out | ios::binary);
+		if (!out.is_open()) { out.open(path, ios::out | ios::binary); }
+		if (!out.is_open()) { cerr << "Error, can't write " << path << endl; throw 1; }
+		out.seekp(validSize);
+		out.write((const char*)&header, sizeof(header));
+		out.write((const char*)points.data(), points.size() * sizeof(PointRecord));
+		for (int i = 0; i < descriptors.rows; i++) {
+			out.write((const char*)descriptors.ptr(i), descriptors.cols);
+		}
+		uint64_t size = recordSize(header);
+		uint64_t written = sizeof(header) + points.size() * sizeof(PointRecord) + descriptors.total();
+		const char zeros[8] = { 0 };
+		out.write(zeros, size - written);
+		if (!out) { cerr << "Error, can't write " << path << endl; throw 1; }
+		validSize += size;
+
+		Entry& entry = entries[key];
+		entry.keypoints = keypoints;
+		entry.descriptors = descriptors;
+	}
+
+	// features of an image from the cache, or computed and stored
+	// (results under a time budget depend on the machine and are never stored)
+	void detectAndCompute(SIFT& sift, const Mat& image,
+		vector<KeyPoint>& keypoints, Mat& descriptors) {
+
+		uint64_t imageKey = key(image, sift);
+		if (get(imageKey, keypoints, descriptors)) { return; }
+		sift.detectAndCompute(image, noArray(), keypoints, descriptors);
+		if (sift.timeBudget <= 0) { put(imageKey, keypoints, descriptors); }
+	}
+
+private:
+	// records start on 8 bytes boundaries
+	static uint64_t recordSize(const RecordHeader& header) {
+		uint64_t size = sizeof(RecordHeader) +
+			(uint64_t)header.nbPoints * (sizeof(PointRecord) + header.descCols);
+		return (size + 7) / 8 * 8;
+	}
+
+	void load() {
+
+		const uchar* data = mapping->data;
+		size_t size = mapping->size;
+		uint64_t offset = 0;
+		while (offset + sizeof(RecordHeader) <= size) {
+			const RecordHeader& header = *(const RecordHeader*)(data + offset);
+			if (header.magic != magic || offset + recordSize(header) > size) { break; } // interrupted
+
+			const PointRecord* points = (const PointRecord*)(data + offset + sizeof(RecordHeader));
+			uchar* desc = (uchar*)(points + header.nbPoints);
+
+			Entry& entry = entries[header.key];
+			entry.keypoints.resize(header.nbPoints);
+			for (uint i = 0; i < header.nbPoints; i++) {
+				const PointRecord& p = points[i];
+				entry.keypoints[i] = KeyPoint(p.x, p.y, p.size, p.angle, p.response, p.octave, p.classId);
+			}
+			entry.descriptors = mappedMat(header.nbPoints, header.descCols, desc);
+
+			offset += recordSize(header);
+		}
+		validSize = offset;
+	}
+
+	// Mat header over the mapping, keeping it open
+	Mat mappedMat(int rows, int cols, uchar* data) const {
+		Mat m(rows, cols, CV_8U, data);
+		UMatData* u = new UMatData(MappingAllocator::get());
+		u->data = u->origdata = data;
+		u->size = m.total() * m.elemSize();
+		u->userdata = new shared_ptr<Mapping>(mapping);
+		u->refcount = 1;
+		m.u = u;
+		return m;
+	}
+};
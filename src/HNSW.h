@@ -0,0 +1,228 @@
+#pragma once
+
+#include <opencv2\opencv.hpp>
+#include <vector>
+#include <queue>
+
+#include "Parallel.h"
+#include "Matcher.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+	Approximate nearest neighbors of SIFT descriptors across many frames,
+	with a Hierarchical Navigable Small World graph (Malkov & Yashunin)
+	The descriptors of each new frame are inserted incrementally,
+	and queries are answered by batches in parallel
+	efSearch trades recall for speed
+	Insertions must not run at the same time as queries
+*/
+struct HNSWIndex {
+
+	uint M = 16; // links per node in the upper layers (2 * M in the bottom one), at least 2
+	uint efConstruction = 100; // candidates looked at when inserting a node
+	uint efSearch = 64; // candidates looked at when searching, the more the better the recall
+
+private:
+	struct Node {
+		uint frame, point; // where the descriptor comes from
+		vector<vector<uint>> links; // neighbors in each layer the node belongs to
+	};
+
+	typedef pair<uint, uint> Candidate; // distance, node
+
+	// nodes already seen by a search, cleared in O(1) by changing the tag
+	struct Visited {
+		vector<uint> tags;
+		uint tag = 0;
+
+		void reset(size_t size) {
+			if (tags.size() < size) { tags.resize(size, 0); }
+			if (++tag == 0) { fill(tags.begin(), tags.end(), 0); tag = 1; }
+		}
+		bool visit(uint node) {
+			if (tags[node] == tag) { return false; }
+			tags[node] = tag;
+			return true;
+		}
+	};
+
+	vector<uchar> descriptors; // 128 bytes per node
+	vector<Node> nodes;
+	int entryPoint = -1;
+	int maxLevel = -1;
+	RNG rng;
+	Visited insertVisited;
+
+public:
+	size_t size() const { return nodes.size(); }
+
+	const uchar* descriptor(uint node) const { return &descriptors[128 * (size_t)node]; }
+
+	// inserts every row of the descriptors of a frame
+	void add(const Mat& frameDescriptors, uint frame) {
+		descriptors.reserve(descriptors.size() + 128 * frameDescriptors.rows);
+		for (int i = 0; i < frameDescriptors.rows; i++) {
+			insert(frameDescriptors.ptr<uchar>(i), frame, i);
+		}
+	}
+
+	// k approximate nearest neighbors of every query row, closest first
+	// DMatch::imgIdx is the frame of the neighbor, DMatch::trainIdx its row in that frame
+	// and DMatch::distance the squared euclidean distance
+	void knnSearch(const Mat& queries, uint k, vector<vector<DMatch>>& matches) const {
+
+		matches.assign(queries.rows, vector<DMatch>());
+		if (nodes.empty()) { return; }
+
+		parallelFor(Range(0, queries.rows), [&](const Range& range) {
+			Visited visited;
+			vector<Candidate> found;
+			for (int q = range.start; q < range.end; q++) {
+				search(queries.ptr<uchar>(q), max(k, efSearch), visited, found);
+				for (uint j = 0; j < k && j < found.size(); j++) {
+					const Node& node = nodes[found[j].second];
+					matches[q].push_back(DMatch(q, node.point, node.frame, (float)found[j].first));
+				}
+			}
+		});
+	}
+
+private:
+	uint distance(const uchar* query, uint node) const {
+		return BruteForceMatcher::distance(query, descriptor(node));
+	}
+
+	void insert(const uchar* desc, uint frame, uint point) {
+
+		uint id = (uint)nodes.size();
+		descriptors.insert(descriptors.end(), desc, desc + 128);
+		const uchar* query = descriptor(id);
+
+		// exponentially fewer nodes in each layer
+		int level = (int)(-log(max(rng.uniform(0.0, 1.0), 1e-12)) / log((double)M));
+		Node node;
+		node.frame = frame;
+		node.point = point;
+		node.links.resize(level + 1);
+		nodes.push_back(node);
+
+		if (entryPoint < 0) {
+			entryPoint = id;
+			maxLevel = level;
+			return;
+		}
+
+		// going down the layers above the node
+		uint current = entryPoint;
+		uint dist = distance(query, current);
+		for (int l = maxLevel; l > level; l--) { greedySearch(query, l, current, dist); }
+
+		// linking the node in its layers
+		vector<Candidate> found;
+		vector<uint> neighbors;
+		for (int l = min(level, maxLevel); l >= 0; l--) {
+			insertVisited.reset(nodes.size());
+			searchLayer(query, Candidate(dist, current), efConstruction, l, insertVisited, found);
+			selectNeighbors(found, M, neighbors);
+			nodes[id].links[l] = neighbors;
+
+			uint maxLinks = l == 0 ? 2 * M : M;
+			for (uint n : neighbors) {
+				auto& links = nodes[n].links[l];
+				links.push_back(id);
+				if (links.size() > maxLinks) { shrinkLinks(n, l, maxLinks); }
+			}
+			dist = found[0].first;
+			current = found[0].second;
+		}
+
+		if (level > maxLevel) {
+			maxLevel = level;
+			entryPoint = id;
+		}
+	}
+
+	void search(const uchar* query, uint ef, Visited& visited, vector<Candidate>& found) const {
+
+		uint current = entryPoint;
+		uint dist = distance(query, current);
+		for (int l = maxLevel; l > 0; l--) { greedySearch(query, l, current, dist); }
+
+		visited.reset(nodes.size());
+		searchLayer(query, Candidate(dist, current), ef, 0, visited, found);
+	}
+
+	// moves to the closest neighbor until none is closer
+	void greedySearch(const uchar* query, int level, uint& current, uint& dist) const {
+		bool changed = true;
+		while (changed) {
+			changed = false;
+			for (uint n : nodes[current].links[level]) {
+				uint d = distance(query, n);
+				if (d < dist) {
+					dist = d;
+					current = n;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	// the ef closest nodes reachable from the entry in one layer, closest first
+	void searchLayer(const uchar* query, Candidate entry, uint ef, int level,
+		Visited& visited, vector<Candidate>& found) const {
+
+		priority_queue<Candidate, vector<Candidate>, greater<Candidate>> candidates; // closest on top
+		priority_queue<Candidate> best; // farthest on top
+
+		visited.visit(entry.second);
+		candidates.push(entry);
+		best.push(entry);
+
+		while (!candidates.empty()) {
+			Candidate c = candidates.top();
+			if (best.size() >= ef && c.first > best.top().first) { break; } // nothing closer left
+			candidates.pop();
+
+			for (uint n : nodes[c.second].links[level]) {
+				if (!visited.visit(n)) { continue; }
+				uint d = distance(query, n);
+				if (best.size() < ef || d < best.top().first) {
+					candidates.push(Candidate(d, n));
+					best.push(Candidate(d, n));
+					if (best.size() > ef) { best.pop(); }
+				}
+			}
+		}
+
+		found.resize(best.size());
+		for (size_t i = found.size(); i-- > 0;) {
+			found[i] = best.top();
+			best.pop();
+		}
+	}
+
+	// heuristic of the paper : a candidate is only linked if it is closer to the node
+	// than to the neighbors already kept, which spreads the links in every direction
+	void selectNeighbors(const vector<Candidate>& sorted, uint m, vector<uint>& neighbors) const {
+		neighbors.clear();
+		for (const auto& c : sorted) {
+			if (neighbors.size() >= m) { break; }
+			bool keep = true;
+			for (uint n : neighbors) {
+				if (distance(descriptor(c.second), n) < c.first) { keep = false; break; }
+			}
+			if (keep) { neighbors.push_back(c.second); }
+		}
+	}
+
+	void shrinkLinks(uint node, int level, uint maxLinks) {
+		auto& links = nodes[node].links[level];
+		vector<Candidate> sorted;
+		for (uint n : links) { sorted.push_back(Candidate(distance(descriptor(node), n), n)); }
+		sort(sorted.begin(), sorted.end());
+		selectNeighbors(sorted, maxLinks, links);
+	}
+};
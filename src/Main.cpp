@@ -22,38 +22,36 @@ int main() {
 	OpenGLMain(mesh);*/
 
 	cv::Mat src = cv::imread("Poisson/bust.jpg");
-	auto features = Poisson2D::simulateKeyPoints(src, 1);
+	auto features = simulateKeyPoints(src, 1);
 	//cv::imshow("im", imKeys); cv::waitKey();
 
-	Node tree(NULL, { false, false }, 0, 0, src.size().width, src.size().height);
-	for (const auto& feat : features) {
-		tree.addPoint(&feat, 5);
-	}
-	tree.computeGradient();
+	QuadTree tree(features, src.size().width, src.size().height, 5);
+	tree.computeGradient(features);
 	cv::Mat toShow; src.copyTo(toShow);
-	auto startNode = tree
-		.children.getValue({ false,true })
-		.children.getValue({ false,false })
-		;
-	//auto l = startNode.getBorderLeaves(0, true);
-	auto l = startNode.getNeighbors(0, true);
-	l.merge(startNode.getNeighbors(0, false));
-	l.merge(startNode.getNeighbors(1, false));
-	l.merge(startNode.getNeighbors(1, true));
+	uint startLeaf = tree.findLeaf(cv::Point2f(src.size().width / 8.f, src.size().height * 5 / 8.f));
+	tree.computeAdjacency();
+	vector<uint> l(tree.adjacency.begin() + tree.adjacencyStart[startLeaf],
+		tree.adjacency.begin() + tree.adjacencyStart[startLeaf + 1]);
 	cout << l.size() << endl;
 
-	startNode.draw(toShow, cv::Scalar(0, 255, 0), cv::FILLED);
-	for (const auto& a : l) {
-		a->draw(toShow, cv::Scalar(0, 0, 255), cv::FILLED);
+	tree.drawLeaf(toShow, startLeaf, cv::Scalar(0, 255, 0), cv::FILLED);
+	for (uint a : l) {
+		tree.drawLeaf(toShow, a, cv::Scalar(0, 0, 255), cv::FILLED);
 	}
 	tree.draw(toShow);
 
-	//toShow = Poisson2D::showKeyPoints(features, toShow);
+	//toShow = showKeyPoints(features, toShow);
 	cv::Mat gradTree(src.size(), CV_32FC3); gradTree.setTo(cv::Scalar(0, 0, 0));
 	tree.fillGradient(gradTree);
 	//tree.draw(gradTree);
 
 	cv::imshow("gradient", gradTree);
+
+	TreePoissonSolver solver;
+	solver.solve(tree);
+	cout << tree.size() << " leaves : " << solver.iterations << " iterations, residual " << solver.residual << endl;
+	cv::imshow("integration", 0.5 + solver.resample(tree, src.size().width, src.size().height));
+
 	imshow("quadTree", toShow); cv::waitKey(1);
 	cv::waitKey();
 }
\ No newline at end of file
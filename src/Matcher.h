@@ -0,0 +1,175 @@
+#pragma once
+
+#include <opencv2\opencv.hpp>
+#include <opencv2\core\hal\intrin.hpp>
+#include <vector>
+
+#include "Parallel.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+	Exact matching of SIFT descriptors (one per row, CV_8U),
+	by squared euclidean distance (or hamming distance for binary descriptors),
+	with Lowe's ratio test
+	Distances are computed by blocks of queries x blocks of train descriptors,
+	so that a train block stays in L1 for a whole query block,
+	and each query descriptor is compared to 4 train descriptors at once
+*/
+struct BruteForceMatcher {
+
+	float ratio = 0.8f; // best distance / second best distance (1 to keep every match)
+	bool crossCheck = false; // only keeps the matches that are also the best of their train point
+	int normType = NORM_L2SQR; // or NORM_HAMMING
+
+	// size of a block of descriptors
+	static const int blockSize = 64;
+
+	// squared euclidean distance between 2 descriptors of 128 bytes
+	static uint distance(const uchar* a, const uchar* b) {
+		return distance(a, b, 128);
+	}
+
+	// squared euclidean distance between 2 descriptors of any length
+	static uint distance(const uchar* a, const uchar* b, int length) {
+		int j = 0;
+		uint dist = 0;
+#if CV_SIMD128
+		v_int32x4 sum = v_setzero_s32();
+		for (; j <= length - 16; j += 16) { sum += squaredDiffSum(v_load(a + j), v_load(b + j)); }
+		dist = (uint)v_reduce_sum(sum);
+#endif
+		for (; j < length; j++) {
+			int d = ((int)a[j]) - b[j];
+			dist += d*d;
+		}
+		return dist;
+	}
+
+	// squared euclidean distances between a descriptor and 4 others :
+	// a is loaded once for the 4, and the 4 sums stay in registers until the end
+	static void distance4(const uchar* a, const uchar* const b[4], int length, uint dist[4]) {
+		int j = 0;
+		for (int k = 0; k < 4; k++) { dist[k] = 0; }
+#if CV_SIMD128
+		v_int32x4 sum0 = v_setzero_s32(), sum1 = v_setzero_s32(), sum2 = v_setzero_s32(), sum3 = v_setzero_s32();
+		for (; j <= length - 16; j += 16) {
+			v_uint8x16 va = v_load(a + j);
+			sum0 += squaredDiffSum(va, v_load(b[0] + j));
+			sum1 += squaredDiffSum(va, v_load(b[1] + j));
+			sum2 += squaredDiffSum(va, v_load(b[2] + j));
+			sum3 += squaredDiffSum(va, v_load(b[3] + j));
+		}
+		dist[0] = (uint)v_reduce_sum(sum0);
+		dist[1] = (uint)v_reduce_sum(sum1);
+		dist[2] = (uint)v_reduce_sum(sum2);
+		dist[3] = (uint)v_reduce_sum(sum3);
+#endif
+		for (; j < length; j++) {
+			for (int k = 0; k < 4; k++) {
+				int d = ((int)a[j]) - b[k][j];
+				dist[k] += d*d;
+			}
+		}
+	}
+
+	// number of different bits (popcount based)
+	static uint hammingDistance(const uchar* a, const uchar* b, int length) {
+		return (uint)hal::normHamming(a, b, length);
+	}
+
+	// the best match of each query descriptor in train,
+	// if it passes the ratio test (and the cross check)
+	// DMatch::distance is the squared euclidean (or hamming) distance
+	void match(const Mat& query, const Mat& train, vector<DMatch>& matches) const {
+
+		matches.clear();
+		if (query.rows == 0 || train.rows == 0) { return; }
+
+		vector<Best2> best;
+		findBest2(query, train, best);
+
+		vector<Best2> bestOfTrain;
+		if (crossCheck) { findBest2(train, query, bestOfTrain); }
+
+		float ratio2 = normType == NORM_HAMMING ? ratio : ratio * ratio; // euclidean distances are squared
+		for (int i = 0; i < query.rows; i++) {
+			const Best2& b = best[i];
+			if (ratio < 1 && b.dist1 >= ratio2 * b.dist2) { continue; }
+			if (crossCheck && bestOfTrain[b.index].index != i) { continue; }
+			matches.push_back(DMatch(i, b.index, (float)b.dist1));
+		}
+	}
+
+private:
+	struct Best2 {
+		uint dist1 = UINT_MAX, dist2 = UINT_MAX; // best and second best distances
+		int index = -1; // index of the best
+
+		void update(uint dist, int t) {
+			if (dist < dist1) {
+				dist2 = dist1;
+				dist1 = dist;
+				index = t;
+			}
+			else if (dist < dist2) {
+				dist2 = dist;
+			}
+		}
+	};
+
+#if CV_SIMD128
+	// sums of squared differences of 16 bytes, as 4 partial sums
+	static v_int32x4 squaredDiffSum(const v_uint8x16& a, const v_uint8x16& b) {
+		v_uint16x8 d0, d1;
+		v_expand(v_absdiff(a, b), d0, d1);
+		v_int16x8 s0 = v_reinterpret_as_s16(d0);
+		v_int16x8 s1 = v_reinterpret_as_s16(d1);
+		return v_dotprod(s0, s0) + v_dotprod(s1, s1);
+	}
+#endif
+
+	// 2 best distances of every query descriptor, in parallel over the query blocks
+	void findBest2(const Mat& query, const Mat& train, vector<Best2>& best) const {
+
+		if (query.cols != train.cols) { cerr << "Error : descriptors of different sizes" << endl; throw 1; }
+		int length = query.cols;
+		bool hamming = normType == NORM_HAMMING;
+
+		best.assign(query.rows, Best2());
+		int nbQueryBlocks = (query.rows + blockSize - 1) / blockSize;
+
+		parallelFor(Range(0, nbQueryBlocks), [&](const Range& range) {
+			for (int qb = range.start; qb < range.end; qb++) {
+				int q0 = qb * blockSize, q1 = min(q0 + blockSize, query.rows);
+
+				for (int t0 = 0; t0 < train.rows; t0 += blockSize) {
+					int t1 = min(t0 + blockSize, train.rows);
+
+					for (int q = q0; q < q1; q++) {
+						const uchar* values0 = query.ptr<uchar>(q);
+						Best2& b = best[q];
+						int t = t0;
+						if (!hamming) {
+							// by 4 train descriptors
+							for (; t <= t1 - 4; t += 4) {
+								const uchar* values1[4] = { train.ptr<uchar>(t), train.ptr<uchar>(t + 1),
+									train.ptr<uchar>(t + 2), train.ptr<uchar>(t + 3) };
+								uint dist[4];
+								distance4(values0, values1, length, dist);
+								for (int k = 0; k < 4; k++) { b.update(dist[k], t + k); }
+							}
+						}
+						for (; t < t1; t++) {
+							const uchar* values1 = train.ptr<uchar>(t);
+							b.update(hamming ?
+								hammingDistance(values0, values1, length) :
+								distance(values0, values1, length), t);
+						}
+					}
+				}
+			}
+		});
+	}
+};
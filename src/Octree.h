@@ -0,0 +1,44 @@
+#pragma once
+
+#include <opencv2\opencv.hpp>
+#include <vector>
+
+#include "SpaceTree.h"
+#include "Mesh.h"
+
+/*
+	Octree over the points of a mesh (a linear tree in 3D over their positions),
+	in the bounding box of the points
+*/
+struct Octree : SpaceTree<3> {
+
+	Octree(const Mesh& mesh, uint maxDepth = 8, uint leafCapacity = 8) :
+		Octree(mesh, bounds(mesh), maxDepth, leafCapacity) {}
+
+	static Point position(const Mesh::Vec3& v) { return Point(v.x, v.y, v.z); }
+
+	using SpaceTree<3>::findLeaf;
+	uint findLeaf(const Mesh::Vec3& v) const { return findLeaf(position(v)); }
+
+private:
+	Octree(const Mesh& mesh, const pair<Point, Point>& box, uint maxDepth, uint leafCapacity) :
+		SpaceTree<3>(box.first, box.second, maxDepth, leafCapacity) {
+
+		build((uint)mesh.points.size(), [&](uint p) { return position(mesh.points[p].pos); });
+	}
+
+	// lowest corner and extent of the points (not flat along any dimension)
+	static pair<Point, Point> bounds(const Mesh& mesh) {
+		Point low(0, 0, 0), high(0, 0, 0);
+		for (uint p = 0; p < mesh.points.size(); p++) {
+			Point pos = position(mesh.points[p].pos);
+			for (uint d = 0; d < 3; d++) {
+				low[d] = p == 0 ? pos[d] : std::min(low[d], pos[d]);
+				high[d] = p == 0 ? pos[d] : std::max(high[d], pos[d]);
+			}
+		}
+		Point extent;
+		for (uint d = 0; d < 3; d++) { extent[d] = high[d] > low[d] ? high[d] - low[d] : 1.f; }
+		return { low, extent };
+	}
+};
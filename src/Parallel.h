@@ -0,0 +1,46 @@
+#pragma once
+
+#include <opencv2\opencv.hpp>
+#include <vector>
+#include <algorithm>
+
+// parallel_for_ on a lambda without the std::function
+// of OpenCV's lambda overload, which may allocate
+template<typename Body>
+struct LambdaBody : public cv::ParallelLoopBody {
+	const Body& body;
+	LambdaBody(const Body& body) : body(body) {}
+	void operator()(const cv::Range& range) const { body(range); }
+};
+
+template<typename Body>
+void parallelFor(const cv::Range& range, const Body& body, double nstripes = -1) {
+	cv::parallel_for_(range, LambdaBody<Body>(body), nstripes);
+}
+
+// loop over [0, n) in parallel, by chunks of indices
+const int parallelChunkSize = 4096;
+
+template<typename Body>
+void parallelRange(int n, const Body& body) {
+	parallelFor(cv::Range(0, (n + parallelChunkSize - 1) / parallelChunkSize), [&](const cv::Range& range) {
+		for (int i = range.start * parallelChunkSize; i < std::min(range.end * parallelChunkSize, n); i++) { body(i); }
+	});
+}
+
+// by chunks summed in a fixed order, so that the result doesn't depend on the threads
+inline double parallelDot(const std::vector<float>& a, const std::vector<float>& b, std::vector<double>& partialSums) {
+	int n = (int)a.size();
+	int nbChunks = (n + parallelChunkSize - 1) / parallelChunkSize;
+	partialSums.assign(nbChunks, 0);
+	parallelFor(cv::Range(0, nbChunks), [&](const cv::Range& range) {
+		for (int chunk = range.start; chunk < range.end; chunk++) {
+			double sum = 0;
+			for (int i = chunk * parallelChunkSize; i < std::min((chunk + 1) * parallelChunkSize, n); i++) { sum += a[i] * b[i]; }
+			partialSums[chunk] = sum;
+		}
+	});
+	double sum = 0;
+	for (double s : partialSums) { sum += s; }
+	return sum;
+}
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <opencv2\opencv.hpp>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <functional>
+
+#include "SIFT.h"
+#include "Matcher.h"
+
+using namespace cv;
+using namespace std;
+
+// spins a few times, then sleeps
+inline void backoff(uint& tries) {
+	if (tries++ < 64) { this_thread::yield(); }
+	else { this_thread::sleep_for(chrono::microseconds(100)); }
+}
+
+/*
+	Bounded lock-free queue for several producers and consumers (Vyukov's ring buffer)
+	push waits for a free cell, so a slow consumer slows its producers down (backpressure)
+*/
+template<typename T>
+struct BoundedQueue {
+
+private:
+	struct Cell {
+		atomic<size_t> sequence;
+		T value;
+	};
+
+	vector<Cell> cells;
+	size_t mask;
+	atomic<size_t> enqueuePos, dequeuePos;
+	atomic<bool> closed;
+
+	// occupation seen by the producers
+	atomic<uint64_t> depthSum, depthSamples;
+	atomic<size_t> maxDepth;
+
+	static size_t powerOf2(size_t n) {
+		size_t p = 2;
+		while (p < n) { p *= 2; }
+		return p;
+	}
+
+public:
+	BoundedQueue(size_t capacity) : cells(powerOf2(capacity)), mask(cells.size() - 1),
+		enqueuePos(0), dequeuePos(0), closed(false), depthSum(0), depthSamples(0), maxDepth(0) {
+		for (size_t i = 0; i < cells.size(); i++) { cells[i].sequence.store(i, memory_order_relaxed); }
+	}
+
+	bool tryPush(T& value) {
+		size_t pos = enqueuePos.load(memory_order_relaxed);
+		Cell* cell;
+		for (;;) {
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if (dif == 0) {
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) { break; }
+			}
+			else if (dif < 0) { return false; } // full
+			else { pos = enqueuePos.load(memory_order_relaxed); }
+		}
+		cell->value = move(value);
+		cell->sequence.store(pos + 1, memory_order_release);
+		return true;
+	}
+
+	bool tryPop(T& value) {
+		size_t pos = dequeuePos.load(memory_order_relaxed);
+		Cell* cell;
+		for (;;) {
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (dif == 0) {
+				if (dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) { break; }
+			}
+			else if (dif < 0) { return false; } // empty
+			else { pos = dequeuePos.load(memory_order_relaxed); }
+		}
+		value = move(cell->value);
+		cell->sequence.store(pos + mask + 1, memory_order_release);
+		return true;
+	}
+
+	// waits while the queue is full
+	void push(T& value) {
+		size_t depth = size();
+		depthSum += depth;
+		depthSamples++;
+		size_t prevMax = maxDepth.load();
+		while (depth > prevMax && !maxDepth.compare_exchange_weak(prevMax, depth)) {}
+
+		uint tries = 0;
+		while (!tryPush(value)) { backoff(tries); }
+	}
+
+	// waits while the queue is empty, false once it is empty and closed
+	bool pop(T& value) {
+		uint tries = 0;
+		for (;;) {
+			if (tryPop(value)) { return true; }
+			if (closed.load()) { return tryPop(value); }
+			backoff(tries);
+		}
+	}
+
+	// no more values will be pushed
+	void close() { closed.store(true); }
+
+	size_t capacity() const { return cells.size(); }
+	size_t size() const { return enqueuePos.load() - dequeuePos.load(); }
+	size_t maxSize() const { return maxDepth.load(); }
+	float meanSize() const { return depthSamples > 0 ? (float)depthSum.load() / depthSamples.load() : 0.f; }
+};
+
+/*
+	Puts back in order values produced out of order by several threads, for a single consumer :
+	the value i goes to the slot i % capacity, and its producer waits until the value i - capacity is consumed
+	The value expected by the consumer never waits, so the producers can't be blocked forever
+*/
+template<typename T>
+struct ReorderBuffer {
+
+private:
+	struct Slot {
+		atomic<int> index; // of the value in the slot, -1 when free
+		T value;
+	};
+
+	vector<Slot> slots;
+	atomic<int> next; // index expected by the consumer
+	atomic<bool> closed;
+	atomic<size_t> count; // of full slots
+
+	atomic<uint64_t> depthSum, depthSamples;
+	atomic<size_t> maxDepth;
+
+public:
+	ReorderBuffer(size_t capacity) : slots(capacity), next(0), closed(false), count(0),
+		depthSum(0), depthSamples(0), maxDepth(0) {
+		for (Slot& slot : slots) { slot.index.store(-1, memory_order_relaxed); }
+	}
+
+	// waits while the slot of the value holds an earlier one
+	void put(int index, T& value) {
+		Slot& slot = slots[index % slots.size()];
+		uint tries = 0;
+		while (index >= next.load(memory_order_acquire) + (int)slots.size()) { backoff(tries); }
+		slot.value = move(value);
+		slot.index.store(index, memory_order_release);
+
+		size_t depth = ++count;
+		depthSum += depth;
+		depthSamples++;
+		size_t prevMax = maxDepth.load();
+		while (depth > prevMax && !maxDepth.compare_exchange_weak(prevMax, depth)) {}
+	}
+
+	// waits for the next value, false once it is missing and no more values will be put
+	bool take(T& value) {
+		int index = next.load(memory_order_relaxed);
+		Slot& slot = slots[index % slots.size()];
+		uint tries = 0;
+		for (;;) {
+			if (slot.index.load(memory_order_acquire) == index) { break; }
+			if (closed.load()) {
+				if (slot.index.load(memory_order_acquire) == index) { break; }
+				return false;
+			}
+			backoff(tries);
+		}
+		value = move(slot.value);
+		count--;
+		slot.index.store(-1, memory_order_relaxed);
+		next.store(index + 1, memory_order_release);
+		return true;
+	}
+
+	// no more values will be put
+	void close() { closed.store(true); }
+
+	size_t capacity() const { return slots.size(); }
+	size_t maxSize() const { return maxDepth.load(); }
+	float meanSize() const { return depthSamples > 0 ? (float)depthSum.load() / depthSamples.load() : 0.f; }
+};
+
+/*
+	Streaming extraction and matching of the frames of a video :
+	a decoding thread, a pool of SIFT extraction workers, and a matching thread
+	matching each frame with the previous ones, connected by bounded queues
+	The features are put back in the order of the frames before the matching, in a buffer
+	of nbWorkers + queueSize slots : a worker ahead of the others waits for its slot
+	Each stage counts its frames and its busy time, and each queue its occupation,
+	so that the bottleneck shows up in printStats
+*/
+struct VideoPipeline {
+
+	struct Frame {
+		int index = -1;
+		Mat image;
+	};
+
+	struct Features {
+		int index = -1;
+		vector<KeyPoint> keypoints;
+		Mat descriptors;
+	};
+
+	struct FrameMatches {
+		const Features* features;
+		vector<pair<int, vector<DMatch>>> matches; // index of a previous frame, matches with it
+	};
+
+	uint nbWorkers = max(1, (int)thread::hardware_concurrency() - 2); // extraction threads
+	uint window = 3; // each frame is matched with this number of previous frames
+	size_t queueSize = 8;
+
+	SIFT sift;
+	BruteForceMatcher matcher;
+	function<void(const FrameMatches&)> onFrame; // called in the order of the frames
+
+	struct StageStats {
+		string name;
+		uint nbThreads = 1;
+		atomic<uint64_t> items;
+		atomic<int64_t> busyTicks;
+		StageStats(const string& name) : name(name), items(0), busyTicks(0) {}
+	};
+
+	StageStats decodeStats{ "decode" }, extractStats{ "extract" }, matchStats{ "match" };
+	double seconds = 0; // duration of the last run
+	size_t decodeQueueMax = 0, featureQueueMax = 0;
+	float decodeQueueMean = 0, featureQueueMean = 0;
+
+	// processes the whole video, returns the number of frames
+	uint run(const string& videoPath) {
+
+		VideoCapture capture(videoPath);
+		if (!capture.isOpened()) { cerr << "Error, can't open " << videoPath << endl; throw 1; }
+
+		BoundedQueue<Frame> frames(queueSize);
+		ReorderBuffer<Features> features(nbWorkers + queueSize); // the workers finish out of order
+		for (StageStats* stage : { &decodeStats, &extractStats, &matchStats }) {
+			stage->items = 0;
+			stage->busyTicks = 0;
+		}
+		extractStats.nbThreads = nbWorkers;
+		int64 start = getTickCount();
+
+		thread decoder([&]() {
+			for (int index = 0;; index++) {
+				int64 t0 = getTickCount();
+				Frame frame;
+				frame.index = index;
+				if (!capture.read(frame.image)) { break; }
+				decodeStats.busyTicks += getTickCount() - t0;
+				decodeStats.items++;
+				frames.push(frame);
+			}
+			frames.close();
+		});
+
+		atomic<uint> runningWorkers(nbWorkers);
+		vector<thread> workers;
+		for (uint w = 0; w < nbWorkers; w++) {
+			workers.push_back(thread([&]() {
+				Frame frame;
+				SIFT::Workspace workspace; // buffers reused for all the frames of this worker
+				while (frames.pop(frame)) {
+					int64 t0 = getTickCount();
+					Features feat;
+					feat.index = frame.index;
+					Mat descriptors;
+					sift.detectAndCompute(workspace, frame.image, noArray(), feat.keypoints, descriptors);
+					feat.descriptors = descriptors.clone(); // the workspace is reused by the next frame
+					extractStats.busyTicks += getTickCount() - t0;
+					extractStats.items++;
+					features.put(feat.index, feat);
+				}
+				if (--runningWorkers == 0) { features.close(); }
+			}));
+		}
+
+		deque<Features> previous;
+		int next = 0;
+		Features current;
+		while (features.take(current)) {
+			int64 t0 = getTickCount();
+			FrameMatches result;
+			result.features = &current;
+			for (const auto& prev : previous) {
+				result.matches.push_back({ prev.index, vector<DMatch>() });
+				matcher.match(current.descriptors, prev.descriptors, result.matches.back().second);
+			}
+			if (onFrame) { onFrame(result); }
+
+			previous.push_back(move(current));
+			if (previous.size() > window) { previous.pop_front(); }
+			next++;
+			matchStats.busyTicks += getTickCount() - t0;
+			matchStats.items++;
+		}
+
+		decoder.join();
+		for (auto& worker : workers) { worker.join(); }
+
+		seconds = (getTickCount() - start) / getTickFrequency();
+		decodeQueueMax = frames.maxSize();
+		decodeQueueMean = frames.meanSize();
+		featureQueueMax = features.maxSize();
+		featureQueueMean = features.meanSize();
+		return next;
+	}
+
+	void printStats(ostream& out) const {
+		out << "pipeline : " << seconds << " s" << endl;
+		for (const StageStats* stage : { &decodeStats, &extractStats, &matchStats }) {
+			double busy = stage->busyTicks.load() / getTickFrequency();
+			out << "  " << stage->name << " : " << stage->items.load() / max(seconds, 1e-9) << " frames/s, " <<
+				100 * busy / max(seconds * stage->nbThreads, 1e-9) << "% busy (" << stage->nbThreads << " threads)" << endl;
+		}
+		out << "  decode -> extract queue : " << decodeQueueMean << " mean, " << decodeQueueMax <<
+			" max of " << queueSize << endl;
+		out << "  extract -> match reordering : " << featureQueueMean << " mean, " << featureQueueMax <<
+			" max of " << nbWorkers + queueSize << endl;
+	}
+};
@@ -1,7 +1,10 @@
+#pragma once
 
 #include <opencv2\opencv.hpp>
 #include <vector>
 
+#include "Parallel.h"
+
 struct Feature {
 
 	cv::Point2f position;
@@ -9,6 +12,656 @@ struct Feature {
 
 };
 
+/*
+	Geometric multigrid solver of lap(u) = f on a regular grid (5 points laplacian),
+	with the first and last rows and columns of u fixed (Dirichlet border).
+	Red-black Gauss-Seidel smoothing, full weighting restriction and bilinear prolongation.
+	A full multigrid pass (from the coarsest level up) gives a first solution,
+	then V-cycles run until the residual is small enough : O(N) for the whole solve.
+	The levels are kept from one solve to the next.
+*/
+struct PoissonSolver {
+
+	uint maxCycles = 20;
+	float tolerance = 1e-4f; // norm of the residual, relative to the norm of f (or of the first residual)
+	uint preSmoothing = 2, postSmoothing = 2; // Gauss-Seidel sweeps around each coarse correction
+	uint coarsestSize = 8; // the coarsest level is only smoothed
+	uint coarsestSweeps = 50;
+
+	// of the last solve
+	uint iterations = 0; // V-cycles after the full multigrid pass
+	float residual = 0; // relative norm of the residual
+
+private:
+	struct Level {
+		cv::Mat u, f, r; // solution (or error), right hand side, residual
+		float lastX = 1, lastY = 1; // length of the last column and row of cells, shorter on odd sizes
+	};
+	std::vector<Level> levels; // from the finest one
+	std::vector<double> rowSums;
+
+public:
+	// u holds the border values (and a first guess inside), and the solution on return
+	void solve(const cv::Mat& f, cv::Mat& u) {
+
+		if (f.type() != CV_32F || u.type() != CV_32F || f.size() != u.size()) {
+			std::cerr << "Error : the solver needs 2 float images of the same size" << std::endl; throw 1;
+		}
+		buildLevels(f.size());
+		levels[0].u = u;
+		levels[0].f = f; // only read
+
+		double r0 = computeResidual(levels[0]);
+		double reference = cv::norm(f) > 0 ? cv::norm(f) : r0;
+		iterations = 0;
+		residual = 0;
+		if (reference == 0) { return; }
+
+		// full multigrid : the whole problem restricted to every level, solved from the coarsest one
+		for (uint l = 1; l < levels.size(); l++) {
+			restrictGrid(levels[l - 1].f, levels[l].f);
+			restrictBorder(levels[l - 1].u, levels[l].u);
+		}
+		smooth(levels.back(), coarsestSweeps);
+		for (int l = (int)levels.size() - 2; l >= 0; l--) {
+			prolongate(levels[l + 1], levels[l], false);
+			vCycle(l);
+		}
+
+		double r = computeResidual(levels[0]);
+		while (r > tolerance * reference && iterations < maxCycles) {
+			vCycle(0);
+			iterations++;
+			r = computeResidual(levels[0]);
+		}
+		residual = (float)(r / reference);
+	}
+
+private:
+	// a coarse node I is the fine node 2I, or the last one for the border :
+	// the last cell of a coarse level can be shorter than the others
+	void buildLevels(cv::Size size) {
+
+		uint nbLevels = 1;
+		for (cv::Size s = size; (uint)std::min(s.width, s.height) > std::max(coarsestSize, 3u); nbLevels++) {
+			s = cv::Size(s.width / 2 + 1, s.height / 2 + 1);
+		}
+		levels.resize(nbLevels);
+
+		auto coarseLast = [](int n, float last) { return (n - 1) % 2 == 0 ? (1 + last) / 2 : last / 2; };
+		for (uint l = 0; l < nbLevels; l++) {
+			Level& level = levels[l];
+			if (l > 0) {
+				level.u.create(size, CV_32F);
+				level.f.create(size, CV_32F);
+				const Level& fine = levels[l - 1];
+				level.lastX = coarseLast(fine.r.cols, fine.lastX);
+				level.lastY = coarseLast(fine.r.rows, fine.lastY);
+			}
+			if (level.r.size() != size) { level.r = cv::Mat::zeros(size, CV_32F); } // the border stays at 0
+			size = cv::Size(size.width / 2 + 1, size.height / 2 + 1);
+		}
+	}
+
+	void vCycle(uint l) {
+
+		Level& level = levels[l];
+		if (l + 1 == levels.size()) {
+			smooth(level, coarsestSweeps);
+			return;
+		}
+
+		// the error of the smoothed solution is smooth, and solved on the coarser level
+		smooth(level, preSmoothing);
+		computeResidual(level);
+		Level& coarse = levels[l + 1];
+		restrictGrid(level.r, coarse.f);
+		coarse.u.setTo(0);
+		vCycle(l + 1);
+		prolongate(coarse, level, true);
+		smooth(level, postSmoothing);
+	}
+
+	// weights of the neighbors in the laplacian of the last inside node,
+	// whose next cell has a length of last (instead of 1)
+	static void lastWeights(float last, float& before, float& after) {
+		before = 2 / (1 + last);
+		after = 2 / (last * (1 + last));
+	}
+
+	// red-black Gauss-Seidel : the points of one color only depend on the other color,
+	// so the rows are updated in parallel
+	static void smooth(Level& level, uint sweeps) {
+
+		cv::Mat& u = level.u;
+		const cv::Mat& f = level.f;
+		int w = u.cols, h = u.rows;
+		float left, right;
+		lastWeights(level.lastX, left, right);
+
+		for (uint s = 0; s < sweeps; s++) {
+			for (int color = 0; color < 2; color++) {
+				parallelFor(cv::Range(1, h - 1), [&](const cv::Range& range) {
+					for (int y = range.start; y < range.end; y++) {
+						float* p = u.ptr<float>(y);
+						const float* up = u.ptr<float>(y - 1);
+						const float* down = u.ptr<float>(y + 1);
+						const float* pf = f.ptr<float>(y);
+						float cu = 1, cd = 1;
+						if (y == h - 2) { lastWeights(level.lastY, cu, cd); }
+						float inv = 1 / (cu + cd + 2);
+
+						int x = 1 + ((1 + y + color) & 1);
+						for (; x < w - 2; x += 2) {
+							p[x] = (cu * up[x] + cd * down[x] + p[x - 1] + p[x + 1] - pf[x]) * inv;
+						}
+						if (x == w - 2) {
+							p[x] = (cu * up[x] + cd * down[x] + left * p[x - 1] + right * p[x + 1] - pf[x]) /
+								(cu + cd + left + right);
+						}
+					}
+				});
+			}
+		}
+	}
+
+	// r = f - lap(u) inside, returns its norm
+	double computeResidual(Level& level) {
+
+		const cv::Mat& u = level.u;
+		const cv::Mat& f = level.f;
+		cv::Mat& r = level.r;
+		int w = u.cols, h = u.rows;
+		float left, right;
+		lastWeights(level.lastX, left, right);
+
+		rowSums.assign(h, 0);
+		parallelFor(cv::Range(1, h - 1), [&](const cv::Range& range) {
+			for (int y = range.start; y < range.end; y++) {
+				const float* p = u.ptr<float>(y);
+				const float* up = u.ptr<float>(y - 1);
+				const float* down = u.ptr<float>(y + 1);
+				const float* pf = f.ptr<float>(y);
+				float* pr = r.ptr<float>(y);
+				float cu = 1, cd = 1;
+				if (y == h - 2) { lastWeights(level.lastY, cu, cd); }
+
+				double sum = 0;
+				for (int x = 1; x < w - 1; x++) {
+					float cl = x == w - 2 ? left : 1;
+					float cr = x == w - 2 ? right : 1;
+					pr[x] = pf[x] - (cu * up[x] + cd * down[x] + cl * p[x - 1] + cr * p[x + 1]
+						- (cu + cd + cl + cr) * p[x]);
+					sum += pr[x] * pr[x];
+				}
+				rowSums[y] = sum;
+			}
+		});
+		double sum = 0;
+		for (double s : rowSums) { sum += s; } // in a fixed order
+		return sqrt(sum);
+	}
+
+	// full weighting, scaled by 4 for the laplacian of the coarse grid (twice the spacing)
+	static void restrictGrid(const cv::Mat& fine, cv::Mat& coarse) {
+
+		parallelFor(cv::Range(1, coarse.rows - 1), [&](const cv::Range& range) {
+			for (int y = range.start; y < range.end; y++) {
+				const float* up = fine.ptr<float>(2 * y - 1);
+				const float* p = fine.ptr<float>(2 * y);
+				const float* down = fine.ptr<float>(2 * y + 1);
+				float* dst = coarse.ptr<float>(y);
+				for (int x = 1; x < coarse.cols - 1; x++) {
+					int fx = 2 * x;
+					dst[x] = 0.25f * (4 * p[fx]
+						+ 2 * (p[fx - 1] + p[fx + 1] + up[fx] + down[fx])
+						+ up[fx - 1] + up[fx + 1] + down[fx - 1] + down[fx + 1]);
+				}
+			}
+		});
+	}
+
+	// border values of the coarse level, the inside starts at 0
+	static void restrictBorder(const cv::Mat& fine, cv::Mat& coarse) {
+
+		int wc = coarse.cols, hc = coarse.rows;
+		auto fineOf = [](int i, int nc, int n) { return i == nc - 1 ? n - 1 : 2 * i; };
+		coarse.setTo(0);
+		for (int y = 0; y < hc; y++) {
+			const float* src = fine.ptr<float>(fineOf(y, hc, fine.rows));
+			float* dst = coarse.ptr<float>(y);
+			if (y == 0 || y == hc - 1) {
+				for (int x = 0; x < wc; x++) { dst[x] = src[fineOf(x, wc, fine.cols)]; }
+			}
+			else {
+				dst[0] = src[0];
+				dst[wc - 1] = src[fine.cols - 1];
+			}
+		}
+	}
+
+	// linear interpolation of the coarse level on the inside of the fine one,
+	// added to it (a correction) or replacing it
+	static void prolongate(const Level& coarseLevel, Level& fineLevel, bool add) {
+
+		const cv::Mat& coarse = coarseLevel.u;
+		cv::Mat& fine = fineLevel.u;
+		int w = fine.cols, h = fine.rows;
+
+		// position of a fine node between its 2 coarse ones
+		// (the last fine node of an odd size is at 1 / (1 + last) of a longer coarse cell)
+		auto weight = [](int i, int n, float last) {
+			return i % 2 == 0 ? 0.f : i == n - 2 ? 1 / (1 + last) : 0.5f;
+		};
+
+		parallelFor(cv::Range(1, h - 1), [&](const cv::Range& range) {
+			for (int y = range.start; y < range.end; y++) {
+				const float* c0 = coarse.ptr<float>(y / 2);
+				const float* c1 = coarse.ptr<float>(std::min((y + 1) / 2, coarse.rows - 1));
+				float ty = weight(y, h, fineLevel.lastY);
+				float* dst = fine.ptr<float>(y);
+				for (int x = 1; x < w - 1; x++) {
+					int x0 = x / 2, x1 = std::min((x + 1) / 2, coarse.cols - 1);
+					float tx = weight(x, w, fineLevel.lastX);
+					float value = (1 - ty) * ((1 - tx) * c0[x0] + tx * c0[x1]) +
+						ty * ((1 - tx) * c1[x0] + tx * c1[x1]);
+					dst[x] = add ? dst[x] + value : value;
+				}
+			}
+		});
+	}
+};
+
+/*
+	Direct solver of lap(u) = f on a whole rectangle, in O(N log N) :
+	the 5 points laplacian is diagonal in the sine basis (fixed border)
+	and in the cosine basis (zero normal derivative), so the solve is
+	a forward transform, a division per frequency and an inverse transform.
+	The transforms of the rows are real DFTs (cv::dft) of their odd or even extension,
+	the columns are transformed as the rows of the transposed image.
+	cv::dft is fastest on sizes with small prime factors.
+*/
+struct SpectralPoissonSolver {
+
+	enum Border {
+		FIXED, // the first and last rows and columns of u are given, as for PoissonSolver
+		NEUMANN // zero normal derivative on the border : the mean of f is ignored, and the mean of u is 0
+	};
+	Border border = FIXED;
+
+private:
+	cv::Mat inside, spectrum, transformed, transposed, ext; // reused from one solve to the next
+	static const int bandSize = 64; // rows transformed at once by a thread
+
+public:
+	// u holds the border values for FIXED, and the solution on return
+	void solve(const cv::Mat& f, cv::Mat& u) {
+
+		if (f.type() != CV_32F || u.type() != CV_32F || f.size() != u.size()) {
+			std::cerr << "Error : the solver needs 2 float images of the same size" << std::endl; throw 1;
+		}
+		if (border == FIXED) { solveFixed(f, u); }
+		else { solveNeumann(f, u); }
+	}
+
+private:
+	void solveFixed(const cv::Mat& f, cv::Mat& u) {
+
+		int w = u.cols, h = u.rows;
+		if (w < 3 || h < 3) { return; }
+		int n = w - 2, m = h - 2; // unknowns
+
+		// the known border values move to the right hand side
+		f(cv::Rect(1, 1, n, m)).copyTo(inside);
+		for (int x = 0; x < n; x++) {
+			inside.at<float>(0, x) -= u.at<float>(0, x + 1);
+			inside.at<float>(m - 1, x) -= u.at<float>(h - 1, x + 1);
+		}
+		for (int y = 0; y < m; y++) {
+			inside.at<float>(y, 0) -= u.at<float>(y + 1, 0);
+			inside.at<float>(y, n - 1) -= u.at<float>(y + 1, w - 1);
+		}
+
+		transform2D(inside, spectrum, [this](const cv::Mat& src, cv::Mat& dst) { sineRows(src, dst); });
+
+		// eigenvalues of the laplacian with a zero border
+		std::vector<float> eigenX(n), eigenY(m);
+		for (int k = 0; k < n; k++) { eigenX[k] = 2 * (float)cos(CV_PI * (k + 1) / (n + 1)) - 2; }
+		for (int k = 0; k < m; k++) { eigenY[k] = 2 * (float)cos(CV_PI * (k + 1) / (m + 1)) - 2; }
+		float scale = 4.f / ((n + 1) * (m + 1)); // the sine transform is its own inverse up to this scale
+		parallelFor(cv::Range(0, m), [&](const cv::Range& range) {
+			for (int y = range.start; y < range.end; y++) {
+				float* p = spectrum.ptr<float>(y);
+				for (int x = 0; x < n; x++) { p[x] *= scale / (eigenX[x] + eigenY[y]); }
+			}
+		});
+
+		transform2D(spectrum, inside, [this](const cv::Mat& src, cv::Mat& dst) { sineRows(src, dst); });
+		inside.copyTo(u(cv::Rect(1, 1, n, m)));
+	}
+
+	void solveNeumann(const cv::Mat& f, cv::Mat& u) {
+
+		int w = u.cols, h = u.rows;
+		transform2D(f, spectrum, [this](const cv::Mat& src, cv::Mat& dst) { cosineRows(src, dst, false); });
+
+		// eigenvalues of the laplacian with mirrored borders, the constant one is 0
+		std::vector<float> eigenX(w), eigenY(h);
+		for (int k = 0; k < w; k++) { eigenX[k] = 2 * (float)cos(CV_PI * k / w) - 2; }
+		for (int k = 0; k < h; k++) { eigenY[k] = 2 * (float)cos(CV_PI * k / h) - 2; }
+		parallelFor(cv::Range(0, h), [&](const cv::Range& range) {
+			for (int y = range.start; y < range.end; y++) {
+				float* p = spectrum.ptr<float>(y);
+				for (int x = 0; x < w; x++) {
+					float eigen = eigenX[x] + eigenY[y];
+					p[x] = eigen != 0 ? p[x] / eigen : 0;
+				}
+			}
+		});
+
+		transform2D(spectrum, u, [this](const cv::Mat& src, cv::Mat& dst) { cosineRows(src, dst, true); });
+	}
+
+	// the same transform on the rows, then on the columns
+	template<typename RowTransform>
+	void transform2D(const cv::Mat& src, cv::Mat& dst, const RowTransform& rows) {
+		rows(src, transformed);
+		cv::transpose(transformed, transposed);
+		rows(transposed, transformed);
+		cv::transpose(transformed, dst);
+	}
+
+	// runs a real DFT on bands of rows of ext in parallel
+	static void dftRows(cv::Mat& ext, int flags) {
+		int nbBands = (ext.rows + bandSize - 1) / bandSize;
+		parallelFor(cv::Range(0, nbBands), [&](const cv::Range& range) {
+			for (int band = range.start; band < range.end; band++) {
+				cv::Mat rows = ext.rowRange(band * bandSize, std::min((band + 1) * bandSize, ext.rows));
+				cv::dft(rows, rows, flags | cv::DFT_ROWS);
+			}
+		});
+	}
+
+	// DST-I of each row : S_k = sum_j x_j sin(pi (j+1) (k+1) / (N+1))
+	// from the DFT of the odd extension (0, x, 0, -reversed x), whose imaginary part is -2 S
+	void sineRows(const cv::Mat& src, cv::Mat& dst) {
+
+		int n = src.cols, l = 2 * (n + 1);
+		ext.create(src.rows, l, CV_32F);
+		for (int y = 0; y < src.rows; y++) {
+			const float* s = src.ptr<float>(y);
+			float* e = ext.ptr<float>(y);
+			e[0] = 0;
+			e[n + 1] = 0;
+			for (int x = 0; x < n; x++) {
+				e[x + 1] = s[x];
+				e[l - 1 - x] = -s[x];
+			}
+		}
+		dftRows(ext, 0);
+
+		// packed output : Re_0, Re_1, Im_1, Re_2, Im_2, ...
+		dst.create(src.rows, n, CV_32F);
+		for (int y = 0; y < src.rows; y++) {
+			const float* e = ext.ptr<float>(y);
+			float* d = dst.ptr<float>(y);
+			for (int k = 0; k < n; k++) { d[k] = -0.5f * e[2 * (k + 1)]; }
+		}
+	}
+
+	// DCT-II of each row : C_k = sum_j x_j cos(pi k (2j+1) / 2N), or its inverse
+	// from the DFT of the even extension (x, reversed x), which is 2 exp(i pi k / 2N) C_k
+	void cosineRows(const cv::Mat& src, cv::Mat& dst, bool inverse) {
+
+		int n = src.cols, l = 2 * n;
+		std::vector<float> c(n), s(n);
+		for (int k = 0; k < n; k++) {
+			c[k] = (float)cos(CV_PI * k / l);
+			s[k] = (float)sin(CV_PI * k / l);
+		}
+		ext.create(src.rows, l, CV_32F);
+		dst.create(src.rows, n, CV_32F);
+
+		if (!inverse) {
+			for (int y = 0; y < src.rows; y++) {
+				const float* p = src.ptr<float>(y);
+				float* e = ext.ptr<float>(y);
+				for (int x = 0; x < n; x++) {
+					e[x] = p[x];
+					e[l - 1 - x] = p[x];
+				}
+			}
+			dftRows(ext, 0);
+			for (int y = 0; y < src.rows; y++) {
+				const float* e = ext.ptr<float>(y);
+				float* d = dst.ptr<float>(y);
+				d[0] = 0.5f * e[0];
+				for (int k = 1; k < n; k++) { d[k] = 0.5f * (e[2 * k - 1] * c[k] + e[2 * k] * s[k]); }
+			}
+		}
+		else {
+			// spectrum of the even extension (C_N = 0), then inverse real DFT
+			for (int y = 0; y < src.rows; y++) {
+				const float* p = src.ptr<float>(y);
+				float* e = ext.ptr<float>(y);
+				e[0] = 2 * p[0];
+				for (int k = 1; k < n; k++) {
+					e[2 * k - 1] = 2 * p[k] * c[k];
+					e[2 * k] = 2 * p[k] * s[k];
+				}
+				e[l - 1] = 0;
+			}
+			dftRows(ext, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+			for (int y = 0; y < src.rows; y++) {
+				const float* e = ext.ptr<float>(y);
+				float* d = dst.ptr<float>(y);
+				for (int x = 0; x < n; x++) { d[x] = e[x]; }
+			}
+		}
+	}
+};
+
+/*
+	Conjugate gradient on A x = b (A symmetric positive definite), from the current x :
+	multiply(v, dst) computes A v, and precondition(res, dst) an approximation of A^-1 res.
+	It stops once the norm of the residual is below tolerance times the norm of b
+	(of the first residual when b is 0), and returns that ratio
+	The vectors are updated in parallel, and the dot products summed in a fixed order
+*/
+struct ConjugateGradientBuffers {
+	std::vector<float> r, z, p, q;
+	std::vector<double> partialSums;
+};
+
+template<typename Multiply, typename Precondition>
+float conjugateGradient(const std::vector<float>& b, std::vector<float>& x,
+	const Multiply& multiply, const Precondition& precondition,
+	float tolerance, uint maxIterations, uint& iterations, ConjugateGradientBuffers& buffers) {
+
+	std::vector<float>& r = buffers.r, &z = buffers.z, &p = buffers.p, &q = buffers.q;
+	std::vector<double>& partialSums = buffers.partialSums;
+	int n = (int)b.size();
+	r.resize(n); z.resize(n); p.resize(n); q.resize(n);
+	iterations = 0;
+
+	multiply(x, q);
+	parallelRange(n, [&](int i) { r[i] = b[i] - q[i]; });
+	double reference = sqrt(parallelDot(b, b, partialSums));
+	if (reference == 0) { reference = sqrt(parallelDot(r, r, partialSums)); }
+
+	precondition(r, z);
+	p = z;
+	double rz = parallelDot(r, z, partialSums);
+	double rNorm = sqrt(parallelDot(r, r, partialSums));
+	while (reference > 0 && rNorm > tolerance * reference && iterations < maxIterations) {
+		multiply(p, q);
+		float alpha = (float)(rz / parallelDot(p, q, partialSums));
+		parallelRange(n, [&](int i) {
+			x[i] += alpha * p[i];
+			r[i] -= alpha * q[i];
+		});
+		precondition(r, z);
+		double rzNext = parallelDot(r, z, partialSums);
+		float beta = (float)(rzNext / rz);
+		rz = rzNext;
+		parallelRange(n, [&](int i) { p[i] = z[i] + beta * p[i]; });
+		rNorm = sqrt(parallelDot(r, r, partialSums));
+		iterations++;
+	}
+	return reference > 0 ? (float)(rNorm / reference) : 0.f;
+}
+
+/*
+	Solver of lap(u) = f on the pixels of a mask only (of any shape) :
+	the pixels of the mask are the unknowns of a sparse system stored in CSR,
+	the other pixels of u are fixed (Dirichlet border), as are the pixels on the border of the image.
+	The system (-lap, symmetric positive definite) is solved by a conjugate gradient,
+	preconditioned by an incomplete Cholesky factorization IC(0).
+	The unknowns are numbered in red-black order (red pixels, with an even x + y, first) :
+	red pixels only have black neighbors, so both triangular solves of the preconditioner
+	are independent per pixel and run in parallel, as the products and the dot products.
+	The cost depends on the size of the mask, not of the image.
+*/
+struct MaskedPoissonSolver {
+
+	uint maxIterations = 2000;
+	float tolerance = 1e-4f; // norm of the residual, relative to the norm of the right hand side
+
+	// of the last solve
+	uint iterations = 0;
+	float residual = 0;
+
+private:
+	// CSR matrix, a row per unknown
+	std::vector<int> rowStart, columns;
+	std::vector<float> values;
+	std::vector<float> diagonal;
+	std::vector<float> schur; // diagonal of the factorization for the black unknowns
+	std::vector<cv::Point> pixels; // of the unknowns
+	int nbRed = 0;
+
+	std::vector<float> x, b;
+	ConjugateGradientBuffers buffers;
+
+public:
+	uint size() const { return (uint)pixels.size(); }
+
+	// u holds the values outside of the mask, and the solution inside
+	void solve(const cv::Mat& f, const cv::Mat& mask, cv::Mat& u) {
+
+		if (f.type() != CV_32F || u.type() != CV_32F || mask.type() != CV_8U ||
+			f.size() != u.size() || f.size() != mask.size()) {
+			std::cerr << "Error : the solver needs 2 float images and a mask of the same size" << std::endl; throw 1;
+		}
+		assemble(f, mask, u);
+		int n = size();
+		iterations = 0;
+		residual = 0;
+		if (n == 0) { return; }
+
+		// first guess : the current values of u
+		x.resize(n);
+		for (int i = 0; i < n; i++) { x[i] = u.at<float>(pixels[i]); }
+
+		residual = conjugateGradient(b, x,
+			[&](const std::vector<float>& v, std::vector<float>& dst) { multiply(v, dst); },
+			[&](const std::vector<float>& res, std::vector<float>& dst) { precondition(res, dst); },
+			tolerance, maxIterations, iterations, buffers);
+
+		for (int i = 0; i < n; i++) { u.at<float>(pixels[i]) = x[i]; }
+	}
+
+private:
+	// -lap(u) = -f, with the fixed neighbors moved to the right hand side
+	void assemble(const cv::Mat& f, const cv::Mat& mask, const cv::Mat& u) {
+
+		int w = f.cols, h = f.rows;
+		cv::Mat index(f.size(), CV_32S, cv::Scalar(-1));
+		pixels.clear();
+		for (int color = 0; color < 2; color++) {
+			for (int y = 1; y < h - 1; y++) {
+				const uchar* m = mask.ptr<uchar>(y);
+				int* id = index.ptr<int>(y);
+				for (int x = 1 + ((1 + y + color) & 1); x < w - 1; x += 2) {
+					if (m[x] == 0) { continue; }
+					id[x] = (int)pixels.size();
+					pixels.push_back(cv::Point(x, y));
+				}
+			}
+			if (color == 0) { nbRed = (int)pixels.size(); }
+		}
+
+		int n = size();
+		rowStart.assign(n + 1, 0);
+		columns.clear();
+		values.clear();
+		diagonal.resize(n);
+		b.resize(n);
+		const cv::Point offsets[4] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+		for (int i = 0; i < n; i++) {
+			const cv::Point& pix = pixels[i];
+			b[i] = -f.at<float>(pix);
+			for (const auto& o : offsets) {
+				cv::Point nb = pix + o;
+				int j = index.at<int>(nb);
+				if (j >= 0) {
+					columns.push_back(j);
+					values.push_back(-1);
+				}
+				else { b[i] += u.at<float>(nb); }
+			}
+			columns.push_back(i);
+			values.push_back(4);
+			diagonal[i] = 4;
+			rowStart[i + 1] = (int)columns.size();
+		}
+
+		// IC(0) : no fill-in, so only the diagonal of the black unknowns changes
+		// (by the products of their red neighbors)
+		schur.assign(n, 0);
+		parallelRange(n - nbRed, [&](int k) {
+			int i = nbRed + k;
+			float s = diagonal[i];
+			for (int e = rowStart[i]; e < rowStart[i + 1]; e++) {
+				int j = columns[e];
+				if (j < nbRed) { s -= values[e] * values[e] / diagonal[j]; }
+			}
+			schur[i] = s;
+		});
+	}
+
+	void multiply(const std::vector<float>& v, std::vector<float>& dst) const {
+		parallelRange(size(), [&](int i) {
+			float sum = 0;
+			for (int e = rowStart[i]; e < rowStart[i + 1]; e++) { sum += values[e] * v[columns[e]]; }
+			dst[i] = sum;
+		});
+	}
+
+	// z = (L L^T)^-1 r, with L = [D_r^1/2, 0 ; A_br D_r^-1/2, S^1/2] :
+	// the black values only need the red residuals, then the red values only need the black ones
+	void precondition(const std::vector<float>& res, std::vector<float>& dst) const {
+		int n = size();
+		parallelRange(n - nbRed, [&](int k) {
+			int i = nbRed + k;
+			float sum = res[i];
+			for (int e = rowStart[i]; e < rowStart[i + 1]; e++) {
+				int j = columns[e];
+				if (j < nbRed) { sum -= values[e] * res[j] / diagonal[j]; }
+			}
+			dst[i] = sum / schur[i];
+		});
+		parallelRange(nbRed, [&](int i) {
+			float sum = res[i];
+			for (int e = rowStart[i]; e < rowStart[i + 1]; e++) {
+				int j = columns[e];
+				if (j >= nbRed) { sum -= values[e] * dst[j]; }
+			}
+			dst[i] = sum / diagonal[i];
+		});
+	}
+};
+
 struct Gradient {
 	uint w, h;
 	cv::Mat x, y;
@@ -51,30 +704,35 @@ struct Gradient {
 	}
 
 	// integrates the gradient by solving a Poisson equation
+	// (the laplacian of the result is the divergence, with a border at 1)
 	cv::Mat poissonIntegration() const {
+		PoissonSolver solver;
+		return poissonIntegration(solver);
+	}
+
+	cv::Mat poissonIntegration(PoissonSolver& solver) const {
 
 		cv::Mat targetLap = getDivergence();
-		cv::Mat dst(targetLap.size(), CV_32F);
-		float* pix = (float*) dst.data;
+		cv::Mat dst(targetLap.size(), CV_32F, cv::Scalar(1)); // border constraints
+		solver.solve(targetLap, dst);
+		return dst;
+	}
 
-		// solver iterations
-		for (uint k = 0; k < 1000; k++) {
-			
-			cv::Mat blurred;
-			cv::GaussianBlur(dst, blurred, cv::Size(7, 7), 3, 3);
-			dst = blurred - targetLap;
+	// same integration on the pixels of a mask only, the other pixels being at 1
+	cv::Mat poissonIntegration(MaskedPoissonSolver& solver, const cv::Mat& mask) const {
 
-			// border constraints
-			for (uint i = 0; i < w; i++) {
-				pix[i] = 1;
-				pix[(h - 1)*w + i] = 1;
-			}
-			for (uint j = 0; j < h; j++) {
-				pix[j*w + 0] = 1;
-				pix[j*w + (w - 1)] = 1;
-			}
-		}
+		cv::Mat targetLap = getDivergence();
+		cv::Mat dst(targetLap.size(), CV_32F, cv::Scalar(1));
+		solver.solve(targetLap, mask, dst);
+		return dst;
+	}
+
+	// same integration with a direct solve (a border at 1, or a zero normal derivative and a mean of 0)
+	cv::Mat poissonIntegration(SpectralPoissonSolver& solver) const {
 
+		cv::Mat targetLap = getDivergence();
+		cv::Mat dst(targetLap.size(), CV_32F, cv::Scalar(1)); // border constraints
+		solver.solve(targetLap, dst);
 		return dst;
 	}
 };
@@ -87,41 +745,174 @@ float max(float a, float b) {
 	return a > b ? a : b;
 }
 
+/*
+	Uniform grid over the positions of features (about 2 features per cell),
+	for nearest neighbor queries in O(1) on average instead of a scan of all the features
+*/
+struct FeatureGrid {
+
+	float cellSize;
+	int cols, rows;
+	std::vector<uint> cellStart; // the features of the cell c are indices[cellStart[c]] to indices[cellStart[c + 1] - 1]
+	std::vector<uint> indices;
+
+	FeatureGrid(const std::vector<Feature>& features, uint w, uint h) {
+
+		cellSize = std::max(1.f, (float)sqrt(2.f * w * h / std::max((size_t)1, features.size())));
+		cols = std::max(1, (int)ceil(w / cellSize));
+		rows = std::max(1, (int)ceil(h / cellSize));
+
+		// counting sort of the features by cell
+		cellStart.assign(cols * rows + 1, 0);
+		for (const auto& feat : features) { cellStart[cellOf(feat.position) + 1]++; }
+		for (uint c = 0; c < cellStart.size() - 1; c++) { cellStart[c + 1] += cellStart[c]; }
+		indices.resize(features.size());
+		std::vector<uint> next(cellStart.begin(), cellStart.end() - 1);
+		for (uint f = 0; f < features.size(); f++) { indices[next[cellOf(features[f].position)]++] = f; }
+	}
+
+	int cellX(float x) const { return std::min(cols - 1, std::max(0, (int)(x / cellSize))); }
+	int cellY(float y) const { return std::min(rows - 1, std::max(0, (int)(y / cellSize))); }
+	uint cellOf(const cv::Point2f& p) const { return cellY(p.y) * cols + cellX(p.x); }
+
+	// distance from a feature to the closest other one (INFINITY if there is none)
+	// the rings of cells around the feature are searched until they can't be closer
+	float nearestDistance(const std::vector<Feature>& features, uint f) const {
+
+		const cv::Point2f& c = features[f].position;
+		int cx = cellX(c.x), cy = cellY(c.y);
+		float best = INFINITY; // squared
+		int maxRing = std::max(std::max(cx, cols - 1 - cx), std::max(cy, rows - 1 - cy));
+
+		for (int ring = 0; ring <= maxRing; ring++) {
+			// the cells of this ring and the next ones are at least ring - 1 cells away
+			float bound = (ring - 1) * cellSize;
+			if (ring > 1 && best <= bound * bound) { break; }
+
+			for (int y = cy - ring; y <= cy + ring; y++) {
+				if (y < 0 || y >= rows) { continue; }
+				bool edgeRow = y == cy - ring || y == cy + ring;
+				for (int x = cx - ring; x <= cx + ring; x += edgeRow ? 1 : 2 * ring) {
+					if (x >= 0 && x < cols) {
+						uint cell = y * cols + x;
+						for (uint i = cellStart[cell]; i < cellStart[cell + 1]; i++) {
+							uint f2 = indices[i];
+							if (f2 == f) { continue; }
+							auto diff = features[f2].position - c;
+							best = std::min(best, diff.dot(diff));
+						}
+					}
+				}
+			}
+		}
+		return sqrt(best);
+	}
+};
+
 struct Cloud {
 	uint w, h;
 	std::vector<Feature> features;
 
+	// distance from each feature to its closest neighbor, queried in parallel
+	std::vector<float> nearestDistances() const {
+
+		FeatureGrid grid(features, w, h);
+		std::vector<float> radii(features.size());
+		parallelFor(cv::Range(0, (int)features.size()), [&](const cv::Range& range) {
+			for (int f = range.start; f < range.end; f++) { radii[f] = grid.nearestDistance(features, f); }
+		});
+		return radii;
+	}
+
+	// the splats are summed by tiles of the image in parallel,
+	// each tile adding the features covering it in their order (as a sequential sum)
+	static const int tileSize = 64;
+
+	// exp(-t^2 / 2) for t in [0, 1], from a table with linear interpolation
+	static float gaussian(float t) {
+		static const int size = 4096;
+		static const std::vector<float> table = []() {
+			std::vector<float> values(size + 2);
+			for (int i = 0; i < size + 2; i++) {
+				float x = (float)i / size;
+				values[i] = exp(-x * x / 2);
+			}
+			return values;
+		}();
+		float pos = t * size;
+		int i = std::min((int)pos, size);
+		return table[i] + (pos - i) * (table[i + 1] - table[i]);
+	}
+
 	Gradient reconstructGradient() const {
 
 		Gradient dst(w, h);
-		float* pixX = (float*) dst.x.data;
-		float* pixY = (float*) dst.y.data;
-
+		std::vector<float> radii = nearestDistances();
+
+		// pixels with a squared distance to the feature below its radius
+		// (features without neighbors, or with one at the same place, add nothing)
+		struct Splat { int i0, i1, j0, j1; };
+		std::vector<Splat> splats(features.size(), Splat{ 0, 0, 0, 0 });
+		int tilesX = (w + tileSize - 1) / tileSize;
+		int tilesY = (h + tileSize - 1) / tileSize;
+		std::vector<std::vector<uint>> tileFeatures(tilesX * tilesY);
 		for (uint f = 0; f < features.size(); f++) {
-			const Feature& feat = features[f];
-			const cv::Point2f& c = feat.position;
-			float radius = INFINITY;
-			for (uint f2 = 0; f2 < features.size(); f2++) {
-				if (f == f2) { continue; }
-				auto diff = features[f2].position - feat.position;
-				float dist = diff.dot(diff);
-				if (dist < radius) {
-					radius = dist;
+			const cv::Point2f& c = features[f].position;
+			float radius = radii[f];
+			if (!(radius > 0) || std::isinf(radius)) { continue; }
+			Splat& splat = splats[f];
+			splat.i0 = (int)std::max(0.f, c.x - radius);
+			splat.i1 = (int)ceil(std::min((float)(w - 1), c.x + radius));
+			splat.j0 = (int)std::max(0.f, c.y - radius);
+			splat.j1 = (int)ceil(std::min((float)(h - 1), c.y + radius));
+			if (splat.i0 >= splat.i1 || splat.j0 >= splat.j1) { continue; }
+			for (int ty = splat.j0 / tileSize; ty <= (splat.j1 - 1) / tileSize; ty++) {
+				for (int tx = splat.i0 / tileSize; tx <= (splat.i1 - 1) / tileSize; tx++) {
+					tileFeatures[ty * tilesX + tx].push_back(f);
 				}
 			}
-			radius = sqrt(radius);
-			for (uint i = max(0, c.x - radius); i < min(w - 1, c.x + radius); i++) {
-				for (uint j = max(0, c.y - radius); j < min(h - 1, c.y + radius); j++) {
-					float dist = (c.x - i)*(c.x - i) + (c.y - j)*(c.y - j);
-					if (dist < radius) {
-						// gaussian
-						float factor = (1/radius) * exp(-(dist*dist)/(2*radius*radius));
-						pixX[j*w + i] += feat.normal[0] * factor;
-						pixY[j*w + i] += feat.normal[1] * factor;
+		}
+
+		parallelFor(cv::Range(0, tilesX * tilesY), [&](const cv::Range& range) {
+			// private accumulation buffers, copied to the image once the tile is done
+			std::vector<float> sumX(tileSize * tileSize), sumY(tileSize * tileSize);
+			for (int tile = range.start; tile < range.end; tile++) {
+				int x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+				int tw = std::min(tileSize, (int)w - x0), th = std::min(tileSize, (int)h - y0);
+				std::fill(sumX.begin(), sumX.end(), 0.f);
+				std::fill(sumY.begin(), sumY.end(), 0.f);
+
+				for (uint f : tileFeatures[tile]) {
+					const Feature& feat = features[f];
+					const cv::Point2f& c = feat.position;
+					const Splat& splat = splats[f];
+					float radius = radii[f];
+					float invRadius = 1 / radius;
+					float normalX = feat.normal[0] * invRadius, normalY = feat.normal[1] * invRadius;
+					int i0 = std::max(splat.i0, x0), i1 = std::min(splat.i1, x0 + tw);
+					int j0 = std::max(splat.j0, y0), j1 = std::min(splat.j1, y0 + th);
+					for (int j = j0; j < j1; j++) {
+						float dy2 = (c.y - j)*(c.y - j);
+						float* rowX = &sumX[(j - y0) * tileSize];
+						float* rowY = &sumY[(j - y0) * tileSize];
+						for (int i = i0; i < i1; i++) {
+							float dist = (c.x - i)*(c.x - i) + dy2;
+							if (dist < radius) {
+								// gaussian
+								float factor = gaussian(dist * invRadius);
+								rowX[i - x0] += normalX * factor;
+								rowY[i - x0] += normalY * factor;
+							}
+						}
 					}
 				}
+
+				for (int j = 0; j < th; j++) {
+					std::copy(&sumX[j * tileSize], &sumX[j * tileSize] + tw, dst.x.ptr<float>(y0 + j) + x0);
+					std::copy(&sumY[j * tileSize], &sumY[j * tileSize] + tw, dst.y.ptr<float>(y0 + j) + x0);
+				}
 			}
-		}
+		});
 
 		return dst;
 	}
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <opencv2\opencv.hpp>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+
+#include "Poisson.h"
+
+/*
+	Float image stored on disk (width and height, then the rows),
+	read and written by rectangles so that it never has to fit in memory
+*/
+struct RawImage {
+
+	std::string path;
+	uint w = 0, h = 0;
+
+private:
+	static const std::streamoff headerSize = 2 * sizeof(uint32_t);
+	std::fstream file;
+
+public:
+	// opens an existing image
+	RawImage(const std::string& path) : path(path) {
+		file.open(path, std::ios::in | std::ios::out | std::ios::binary);
+		if (!file.is_open()) { std::cerr << "Error, can't open " << path << std::endl; throw 1; }
+		uint32_t size[2];
+		file.read((char*)size, sizeof(size));
+		if (!file) { std::cerr << "Error, can't read " << path << std::endl; throw 1; }
+		w = size[0];
+		h = size[1];
+	}
+
+	// creates an image of zeros, one row at a time
+	RawImage(const std::string& path, uint w, uint h) : path(path), w(w), h(h) {
+		file.open(path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) { std::cerr << "Error, can't write " << path << std::endl; throw 1; }
+		uint32_t size[2] = { w, h };
+		file.write((const char*)size, sizeof(size));
+		std::vector<float> zeros(w, 0.f);
+		for (uint y = 0; y < h; y++) { file.write((const char*)zeros.data(), w * sizeof(float)); }
+		if (!file) { std::cerr << "Error, can't write " << path << std::endl; throw 1; }
+	}
+
+	// writes a whole image (for images which fit in memory)
+	static void save(const std::string& path, const cv::Mat& image) {
+		RawImage dst(path, image.cols, image.rows);
+		dst.write(cv::Rect(0, 0, image.cols, image.rows), image);
+	}
+
+	cv::Rect rect() const { return cv::Rect(0, 0, w, h); }
+
+	void read(const cv::Rect& r, cv::Mat& dst) {
+		dst.create(r.size(), CV_32F);
+		for (int y = 0; y < r.height; y++) {
+			file.seekg(offset(r.x, r.y + y));
+			file.read((char*)dst.ptr<float>(y), r.width * sizeof(float));
+		}
+		if (!file) { std::cerr << "Error, can't read " << path << std::endl; throw 1; }
+	}
+
+	void write(const cv::Rect& r, const cv::Mat& src) {
+		for (int y = 0; y < r.height; y++) {
+			file.seekp(offset(r.x, r.y + y));
+			file.write((const char*)src.ptr<float>(y), r.width * sizeof(float));
+		}
+		if (!file) { std::cerr << "Error, can't write " << path << std::endl; throw 1; }
+	}
+
+private:
+	std::streamoff offset(int x, int y) const {
+		return headerSize + ((std::streamoff)y * w + x) * (std::streamoff)sizeof(float);
+	}
+};
+
+/*
+	Out-of-core integration of a gradient field too big for the memory,
+	by domain decomposition (multiplicative Schwarz with a coarse correction) :
+	starting from 1 everywhere, each iteration
+	- restricts the residual to a coarse image (sums over blocks of factor x factor pixels),
+	  solves the coarse error, and adds it to the whole solution
+	  (this spreads the low frequencies across the tiles)
+	- solves each tile, extended by an overlap, with its border taken from the current solution
+	  (the neighbor tiles already solved, the coarse correction otherwise),
+	  and writes back the inside of the tile
+	The images are streamed by tiles : the memory used is bounded by the coarse image
+	and a few extended tiles. The border of the image is fixed at 1, as Gradient::poissonIntegration.
+*/
+struct TiledPoissonIntegration {
+
+	uint tileSize = 1024; // pixels written by each fine solve
+	uint overlap = 64; // extension of the tiles on each side
+	uint coarseSize = 1024; // largest side of the coarse image
+	uint maxIterations = 10;
+	float tolerance = 1e-4f; // norm of the residual relative to the norm of the divergence
+
+	PoissonSolver solver;
+
+	// of the last integration
+	uint factor = 1; // size of a coarse pixel
+	uint iterations = 0;
+	float residual = 0; // relative norm of the residual
+
+private:
+	cv::Mat gx, gy, u; // buffers of the current tile
+
+public:
+	void integrate(RawImage& gradX, RawImage& gradY, RawImage& dst) {
+
+		if (gradX.w != gradY.w || gradX.h != gradY.h || gradX.w != dst.w || gradX.h != dst.h) {
+			std::cerr << "Error : different sizes" << std::endl; throw 1;
+		}
+		factor = std::max(1u, (std::max(dst.w, dst.h) + coarseSize - 1) / coarseSize);
+
+		forEachTile(dst, blockTileSize(), [&](const cv::Rect& tile) {
+			u.create(tile.size(), CV_32F);
+			u.setTo(1);
+			dst.write(tile, u);
+		});
+
+		cv::Mat sums;
+		iterations = 0;
+		residual = computeResidual(gradX, gradY, dst, sums);
+		while (residual > tolerance && iterations < maxIterations) {
+			coarseCorrection(sums, dst);
+			solveTiles(gradX, gradY, dst);
+			iterations++;
+			residual = computeResidual(gradX, gradY, dst, sums);
+		}
+	}
+
+private:
+	static cv::Rect grow(const cv::Rect& r, int margin) {
+		return cv::Rect(r.x - margin, r.y - margin, r.width + 2 * margin, r.height + 2 * margin);
+	}
+
+	template<typename Body>
+	static void forEachTile(const RawImage& image, int size, const Body& body) {
+		for (int y0 = 0; y0 < (int)image.h; y0 += size) {
+			for (int x0 = 0; x0 < (int)image.w; x0 += size) {
+				body(cv::Rect(x0, y0, std::min(size, (int)image.w - x0), std::min(size, (int)image.h - y0)));
+			}
+		}
+	}
+
+	// tiles made of whole coarse blocks
+	int blockTileSize() const { return std::max(1u, tileSize / factor) * factor; }
+
+	// divergence of the gradient on a rectangle (read with one more pixel around for the derivatives)
+	cv::Mat divergence(RawImage& gradX, RawImage& gradY, const cv::Rect& r) {
+		cv::Rect read = grow(r, 1) & gradX.rect();
+		gradX.read(read, gx);
+		gradY.read(read, gy);
+		return Gradient(gx, gy).getDivergence()(r - read.tl());
+	}
+
+	// sums of the residual over the coarse blocks, returns the relative norm of the residual
+	float computeResidual(RawImage& gradX, RawImage& gradY, RawImage& dst, cv::Mat& sums) {
+
+		int w = dst.w, h = dst.h;
+		sums = cv::Mat::zeros((h + factor - 1) / factor, (w + factor - 1) / factor, CV_32F);
+		double residualNorm = 0, divNorm = 0;
+
+		forEachTile(dst, blockTileSize(), [&](const cv::Rect& tile) {
+			cv::Mat div = divergence(gradX, gradY, tile);
+			cv::Rect read = grow(tile, 1) & dst.rect();
+			dst.read(read, u);
+			for (int y = 0; y < tile.height; y++) {
+				int fy = tile.y + y;
+				if (fy == 0 || fy == h - 1) { continue; } // fixed border
+				const float* pd = div.ptr<float>(y);
+				const float* p = u.ptr<float>(fy - read.y);
+				const float* up = u.ptr<float>(fy - read.y - 1);
+				const float* down = u.ptr<float>(fy - read.y + 1);
+				float* sum = sums.ptr<float>(fy / factor);
+				for (int x = 0; x < tile.width; x++) {
+					int fx = tile.x + x;
+					if (fx == 0 || fx == w - 1) { continue; }
+					int rx = fx - read.x;
+					float r = pd[x] - (up[rx] + down[rx] + p[rx - 1] + p[rx + 1] - 4 * p[rx]);
+					sum[fx / factor] += r;
+					residualNorm += r * r;
+					divNorm += pd[x] * pd[x];
+				}
+			}
+		});
+		return divNorm > 0 ? (float)sqrt(residualNorm / divNorm) : 0.f;
+	}
+
+	// error solved from the sums of the residual over the blocks :
+	// the coarse laplacian is the sum of the fine ones over a block (pixels factor times bigger)
+	void coarseCorrection(const cv::Mat& sums, RawImage& dst) {
+
+		cv::Mat error = cv::Mat::zeros(sums.size(), CV_32F);
+		solver.solve(sums, error);
+
+		int w = dst.w, h = dst.h;
+		forEachTile(dst, blockTileSize(), [&](const cv::Rect& tile) {
+			dst.read(tile, u);
+			for (int y = 0; y < tile.height; y++) {
+				int fy = tile.y + y;
+				if (fy == 0 || fy == h - 1) { continue; }
+				float* p = u.ptr<float>(y);
+				for (int x = 0; x < tile.width; x++) {
+					int fx = tile.x + x;
+					if (fx == 0 || fx == w - 1) { continue; }
+					p[x] += sampleCoarse(error, fx, fy);
+				}
+			}
+			dst.write(tile, u);
+		});
+	}
+
+	void solveTiles(RawImage& gradX, RawImage& gradY, RawImage& dst) {
+
+		forEachTile(dst, tileSize, [&](const cv::Rect& core) {
+			cv::Rect ext = grow(core, overlap) & dst.rect();
+			cv::Mat div = divergence(gradX, gradY, ext);
+			dst.read(ext, u); // border of the extended tile, and first guess inside
+			solver.solve(div, u);
+			dst.write(core, u(core - ext.tl()));
+		});
+	}
+
+	// bilinear interpolation of a coarse image, whose pixels are at the center of their blocks
+	float sampleCoarse(const cv::Mat& coarse, int x, int y) const {
+		float cx = std::min(std::max((x + 0.5f) / factor - 0.5f, 0.f), (float)(coarse.cols - 1));
+		float cy = std::min(std::max((y + 0.5f) / factor - 0.5f, 0.f), (float)(coarse.rows - 1));
+		int x0 = std::max(0, std::min((int)cx, coarse.cols - 2));
+		int y0 = std::max(0, std::min((int)cy, coarse.rows - 2));
+		int x1 = std::min(x0 + 1, coarse.cols - 1), y1 = std::min(y0 + 1, coarse.rows - 1);
+		float ax = cx - x0, ay = cy - y0;
+		return (1 - ay) * ((1 - ax) * coarse.at<float>(y0, x0) + ax * coarse.at<float>(y0, x1)) +
+			ay * ((1 - ax) * coarse.at<float>(y1, x0) + ax * coarse.at<float>(y1, x1));
+	}
+};
@@ -2,215 +2,306 @@
 
 #include <opencv2\opencv.hpp>
 #include <vector>
-#include <stack>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
 
+#include "Parallel.h"
 #include "Poisson.h"
+#include "SpaceTree.h"
 
 using namespace std;
 
-typedef Poisson2D::Feature Feature;
+/*
+	Quadtree over the features of an image (a linear tree in 2D over their positions),
+	with the gradient of each leaf
+*/
+struct QuadTree : SpaceTree<2> {
 
-// values in a multidimensional space (2 directions per dimension)
-template<typename T, uint dimensions>
-struct Space {
-	vector<T> values;
-	// indexes in each dimension	
-	T& getValue( vector<bool> indexes) {
+	vector<cv::Vec2f> gradients; // one per leaf
 
-		if (indexes.size() != dimensions) { // TODO : remove
-			cerr << "Error, accessing space in " <<
-				dimensions << " dimensions with coordinates in " <<
-				indexes.size() << " dimension" << endl; throw 1;
-		}
-		uint index = 0;
-		for (uint i = 0; i < indexes.size(); i++) {
-			index = 2 * index + (indexes[indexes.size() - 1 - i] ? 1 : 0);
-		}
-		return values[index];
-	}
-	// const version, HACK : don't duplicate code
-	const T& getValue(vector<bool> indexes) const {
+	QuadTree(const vector<Feature>& features, float width, float height, uint maxDepth = 5, uint leafCapacity = 1) :
+		SpaceTree<2>(Point(0, 0), Point(width, height), maxDepth, leafCapacity) {
 
-		if (indexes.size() != dimensions) { // TODO : remove
-			cerr << "Error, accessing space in " <<
-				dimensions << " dimensions with coordinates in " <<
-				indexes.size() << " dimension" << endl; throw 1;
-		}
-		uint index = 0;
-		for (uint i = 0; i < indexes.size(); i++) {
-			index = 2 * index + (indexes[indexes.size() - 1 - i] ? 1 : 0);
-		}
-		return values[index];
+		build((uint)features.size(), [&](uint f) { return Point(features[f].position.x, features[f].position.y); });
+		gradients.assign(size(), cv::Vec2f(0, 0));
 	}
-};
 
-struct Node {
+	using SpaceTree<2>::findLeaf;
+	uint findLeaf(const cv::Point2f& p) const { return findLeaf(Point(p.x, p.y)); }
 
-	float x, y, width, height; // space coordinates
-	const Node* parent;
-	const vector<bool> index; // index relative to the parent
-	Space<Node, 2> children;
-	bool isLeaf = true;
-	vector<const Feature*> features;
-	Space<vector<const Node*>, 2> neighbors;
-	Poisson2D::Vec2 gradient;
+	cv::Rect2f rect(uint leaf) const {
+		Point c = corner(leaf), e = cellExtent(leaves[leaf].level);
+		return cv::Rect2f(c[0], c[1], e[0], e[1]);
+	}
+
+	// mean normal of the features of each leaf, per unit of area
+	void computeGradient(const vector<Feature>& features) {
 
-	Node(const Node* parent, vector<bool> index, float x, float y, float width, float height) :
-		parent(parent), index(index), x(x), y(y), width(width), height(height) {}
+		parallelFor(cv::Range(0, size()), [&](const cv::Range& range) {
+			for (int i = range.start; i < range.end; i++) {
+				float gradX = 0, gradY = 0;
+				for (uint f = pointStart[i]; f < pointStart[i + 1]; f++) {
+					gradX += features[pointIndices[f]].normal[0];
+					gradY += features[pointIndices[f]].normal[1];
+				}
+				if (nbPoints(i) > 0) {
+					cv::Rect2f r = rect(i);
+					float factor = r.width * r.height * nbPoints(i);
+					gradX /= factor;
+					gradY /= factor;
+				}
+				gradients[i] = { gradX, gradY };
+			}
+		});
+	}
 
 	void draw(cv::Mat& img, cv::Scalar color = cv::Scalar(128, 0, 0), int thickness = 1) const {
-		if (isLeaf) {
-			cv::rectangle(img, cv::Rect(x, y, width, height), color, thickness);
-		}
-		for (const auto& child : children.values) {
-			child.draw(img, color, thickness);
-			child.draw(img, color, thickness);
-		}
+		for (uint i = 0; i < size(); i++) { drawLeaf(img, i, color, thickness); }
 	}
 
-	void fillGradient(cv::Mat& img) const {
+	void drawLeaf(cv::Mat& img, uint leaf, cv::Scalar color, int thickness = 1) const {
+		cv::Rect2f r = rect(leaf);
+		cv::rectangle(img, cv::Rect((int)r.x, (int)r.y, (int)r.width, (int)r.height), color, thickness);
+	}
 
-		if (isLeaf) { // if leaf, fill
-			for (uint px = x; px < x + width; px++) {
-				for (uint py = y; py < y + height; py++) {
-					float r = 0.5 + 0.5 * 10 * gradient.x;
-					float g = 0.5 + 0.5 * 10 * gradient.y;
-					float b = 0.5;
-					((float*)img.data)[3 * (py*img.size().width + px) + 0] = b;
-					((float*)img.data)[3 * (py*img.size().width + px) + 1] = g;
-					((float*)img.data)[3 * (py*img.size().width + px) + 2] = r;
-				}
-			}
-		}
-		for (const auto& child : children.values) {
-			child.fillGradient(img);
-			child.fillGradient(img);
+	void fillGradient(cv::Mat& img) const {
+		for (uint i = 0; i < size(); i++) {
+			cv::Rect2f r = rect(i);
+			cv::Rect pixels = cv::Rect(cv::Point((int)ceil(r.x), (int)ceil(r.y)),
+				cv::Point((int)ceil(r.x + r.width), (int)ceil(r.y + r.height))) & cv::Rect(0, 0, img.cols, img.rows);
+			const cv::Vec2f& g = gradients[i];
+			img(pixels).setTo(cv::Scalar(0.5, 0.5 + 0.5 * 10 * g[1], 0.5 + 0.5 * 10 * g[0]));
 		}
 	}
+};
 
-	// if collision and depthLeft > 0, split into several children
-	void addPoint(const Feature* feature, uint depthLeft) {
+/*
+	Finite volume solver of lap(u) = div(gradient) on the leaves of a quadtree (one value per leaf),
+	the border of the image being fixed at 1 (as Gradient::poissonIntegration) :
+	the flux through a side between 2 leaves is its length over the distance between their centers
+	times the difference of their values, and the gradient through it the mean of their gradients.
+	The system is solved by a conjugate gradient, preconditioned by a V-cycle over the levels of the tree :
+	the coarse level l merges the leaves deeper than l into their cell of level l (Galerkin coarse matrices),
+	with Jacobi smoothing. The cost depends on the number of leaves, not of pixels.
+	The adjacency of the tree has to be computed before.
+*/
+struct TreePoissonSolver {
 
-		// TODO : every point falls into a leaf at depth D ?
-		if (depthLeft == 0 || (isLeaf && features.size() == 0)) { // is it a leaf ?
-			features.push_back(feature);
-		}
-		else {
-			if (isLeaf) {
-				// creating children nodes
-				children.values = {
-					Node(this, { false,false }, x + 0,y + 0,width / 2,height / 2),
-					Node(this, { true,false }, x + width / 2,y + 0,width / 2,height / 2),
-					Node(this, { false,true }, x + 0,y + height / 2,width / 2,height / 2),
-					Node(this, { true,true }, x + width / 2,y + height / 2,width / 2,height / 2)
-				};
-				isLeaf = false;
-			}
-			features.push_back(feature);
-			for (const Feature* feat : features) {
-				children.getValue({
-					feat->position.x > x + width / 2,
-					feat->position.y > y + height / 2
-				}).addPoint(feat, depthLeft - 1);
-			}
-			features.clear();
+	uint maxIterations = 500;
+	float tolerance = 1e-5f; // norm of the residual, relative to the norm of the right hand side
+	uint smoothing = 2; // Jacobi sweeps before and after the coarse correction
+	float jacobiWeight = 0.67f;
+	uint coarsestLevel = 2; // level of the tree of the coarsest grid
+	uint coarsestSweeps = 50;
+
+	// of the last solve
+	uint iterations = 0;
+	float residual = 0;
+	vector<float> values; // one per leaf
+
+private:
+	struct Level {
+		vector<uint> rowStart, columns;
+		vector<float> coefficients, diagonal;
+		vector<uint64_t> codes; // of the cells of the unknowns
+		vector<uint> aggregates; // unknown of the next coarser level of each unknown
+		vector<float> x, b, r;
+		uint size() const { return (uint)codes.size(); }
+	};
+	vector<Level> levels;
+	vector<float> rhs;
+	ConjugateGradientBuffers buffers;
+
+public:
+	void solve(const QuadTree& tree) {
+
+		if (tree.adjacencyStart.size() != tree.size() + 1) {
+			cerr << "Error : the adjacency of the tree is not computed" << endl; throw 1;
 		}
+		assemble(tree);
+		buildLevels(tree);
+
+		values.assign(tree.size(), 1.f);
+		residual = conjugateGradient(rhs, values,
+			[&](const vector<float>& v, vector<float>& dst) { multiply(levels[0], v, dst); },
+			[&](const vector<float>& res, vector<float>& dst) { precondition(res, dst); },
+			tolerance, maxIterations, iterations, buffers);
 	}
 
-	void computeGradient() {
+	// image of the solution : the value of the leaf of each pixel,
+	// extrapolated from the center of the leaf with its gradient
+	cv::Mat resample(const QuadTree& tree, uint w, uint h) const {
 
-		if (isLeaf) { // if leaf, compute gradient
-			float gradX = 0, gradY = 0;
-			for (const Feature* feat : features) {
-				gradX += feat->normal.x;
-				gradY += feat->normal.y;
-			}
-			if (features.size() > 0) {
-				float factor = width * height * features.size();
-				gradX /= factor;
-				gradY /= factor;
+		cv::Mat dst(cv::Size(w, h), CV_32F);
+		float sx = tree.extent[0] / w, sy = tree.extent[1] / h; // size of a pixel in the tree
+		parallelFor(cv::Range(0, h), [&](const cv::Range& range) {
+			for (int y = range.start; y < range.end; y++) {
+				float* row = dst.ptr<float>(y);
+				float py = (y + 0.5f) * sy;
+				uint leaf = UINT_MAX;
+				cv::Rect2f r;
+				for (uint x = 0; x < w; x++) {
+					float px = (x + 0.5f) * sx;
+					if (leaf == UINT_MAX || px > r.x + r.width) { // entering the next leaf of the row
+						leaf = tree.findLeaf(cv::Point2f(px, py));
+						r = tree.rect(leaf);
+					}
+					const cv::Vec2f& g = tree.gradients[leaf];
+					row[x] = values[leaf] + g[0] * (px - (r.x + r.width / 2)) + g[1] * (py - (r.y + r.height / 2));
+				}
 			}
-			gradient = { gradX, gradY };
-		}
-		for (auto& child : children.values) {
-			child.computeGradient();
-			child.computeGradient();
-		}
+		});
+		return dst;
 	}
 
-	// get border leaf in the given direction of a given dimension
-	list<const Node*> getBorderLeaves(uint dimension, bool direction) const {
-
-		if (isLeaf) { return{ this }; }
-		else {
-			auto list1 = children.getValue({
-				dimension == 0 ? direction : false,
-				dimension == 1 ? direction : false
-			}).getBorderLeaves(dimension, direction);
-			auto list2 = children.getValue({
-				dimension == 0 ? direction : true,
-				dimension == 1 ? direction : true
-			}).getBorderLeaves(dimension, direction);
-			list1.merge(list2);
-			return list1;
-		}
-	}
+private:
+	// A u = b, with A the opposite of the laplacian (symmetric positive definite)
+	void assemble(const QuadTree& tree) {
 
-	// TODO : simpler ?
-	list<const Node*> getBorderLeaves(uint dimension, bool direction, stack<vector<bool>> directions) const {
+		uint n = tree.size();
+		levels.resize(1);
+		Level& fine = levels[0];
+		fine.rowStart.resize(n + 1);
+		fine.columns.resize(tree.adjacency.size() + n);
+		fine.coefficients.resize(tree.adjacency.size() + n);
+		fine.diagonal.resize(n);
+		fine.codes.resize(n);
+		rhs.resize(n);
 
-		if (isLeaf) { return{ this }; }
-		else {
-			if (directions.size() == 0) {
-				return getBorderLeaves(dimension, direction);
+		float cellW = tree.extent[0] / (1u << tree.maxDepth), cellH = tree.extent[1] / (1u << tree.maxDepth);
+		uint32_t cells = 1u << tree.maxDepth;
+		parallelRange(n + 1, [&](int i) { fine.rowStart[i] = tree.adjacencyStart[i] + i; });
+		parallelRange(n, [&](int i) {
+			QuadTree::Cell cell = QuadTree::decode(tree.leaves[i].code);
+			uint32_t x = cell[0], y = cell[1];
+			uint32_t side = 1u << (tree.maxDepth - tree.leaves[i].level);
+			const cv::Vec2f& g = tree.gradients[i];
+			float diag = 0, b = 0;
+			uint e = fine.rowStart[i];
+			for (uint a = tree.adjacencyStart[i]; a < tree.adjacencyStart[i + 1]; a++, e++) {
+				uint j = tree.adjacency[a];
+				QuadTree::Cell nCell = QuadTree::decode(tree.leaves[j].code);
+				uint32_t nx = nCell[0], ny = nCell[1];
+				uint32_t nSide = 1u << (tree.maxDepth - tree.leaves[j].level);
+				// normal from i to j, and distance between the centers along it
+				int dimension = (nx + nSide == x || x + side == nx) ? 0 : 1;
+				float normal = (dimension == 0 ? nx > x : ny > y) ? 1.f : -1.f;
+				float distance = (side + nSide) / 2.f * (dimension == 0 ? cellW : cellH);
+				float t = tree.sideSizes[a] / distance;
+				fine.columns[e] = j;
+				fine.coefficients[e] = -t;
+				diag += t;
+				const cv::Vec2f& gj = tree.gradients[j];
+				b -= normal * (g[dimension] + gj[dimension]) / 2 * tree.sideSizes[a];
 			}
-			else {
-				auto dir = directions.top();
-				dir[dimension] = direction;
-				directions.pop();
-				return children.getValue(dir).getBorderLeaves(dimension, direction, directions);
+			// sides on the border of the image, at 1 at half a leaf from the center
+			for (int dimension = 0; dimension < 2; dimension++) {
+				uint32_t c = dimension == 0 ? x : y;
+				float length = side * (dimension == 0 ? cellH : cellW);
+				float t = length / (side / 2.f * (dimension == 0 ? cellW : cellH));
+				if (c == 0) { diag += t; b += t + g[dimension] * length; }
+				if (c + side == cells) { diag += t; b += t - g[dimension] * length; }
 			}
-		}
+			fine.columns[e] = i;
+			fine.coefficients[e] = diag;
+			fine.diagonal[i] = diag;
+			fine.codes[i] = tree.leaves[i].code;
+			rhs[i] = b;
+		});
 	}
 
-	list<const Node*> getNeighbors(uint dimension, bool direction, stack<vector<bool>>& directions) const {
+	// coarse levels by merging the leaves into their cells of the levels of the tree
+	void buildLevels(const QuadTree& tree) {
 
-		if (parent == NULL) {
-			return{}; // Border of the tree -> no neighbors
-		}
-		vector<bool> targetPos = index;
-		if (targetPos[dimension] == direction) { // you face a wall, go up
-			directions.push(targetPos);
-			return parent->getNeighbors(dimension, direction, directions);
+		for (int level = (int)tree.maxDepth - 1; level >= (int)coarsestLevel; level--) {
+			Level& fine = levels.back();
+			uint64_t mask = ~(tree.cellSize(level) - 1);
+			fine.aggregates.resize(fine.size());
+			Level coarse;
+			for (uint i = 0; i < fine.size(); i++) {
+				uint64_t code = fine.codes[i] & mask;
+				if (coarse.codes.empty() || coarse.codes.back() != code) { coarse.codes.push_back(code); }
+				fine.aggregates[i] = coarse.size() - 1;
+			}
+			if (coarse.size() == fine.size()) { continue; } // no leaf this deep
+			if (coarse.size() <= 1) { fine.aggregates.clear(); break; }
+
+			// Galerkin : the entries of the rows of an aggregate, summed by aggregate of their columns
+			// (the rows of an aggregate are contiguous)
+			coarse.rowStart = { 0 };
+			coarse.diagonal.resize(coarse.size());
+			vector<pair<uint, float>> row;
+			uint i = 0;
+			for (uint c = 0; c < coarse.size(); c++) {
+				row.clear();
+				for (; i < fine.size() && fine.aggregates[i] == c; i++) {
+					for (uint e = fine.rowStart[i]; e < fine.rowStart[i + 1]; e++) {
+						row.push_back({ fine.aggregates[fine.columns[e]], fine.coefficients[e] });
+					}
+				}
+				sort(row.begin(), row.end(), [](const pair<uint, float>& a, const pair<uint, float>& b) { return a.first < b.first; });
+				for (uint k = 0; k < row.size(); k++) {
+					if (k > 0 && row[k].first == row[k - 1].first) { coarse.coefficients.back() += row[k].second; }
+					else {
+						coarse.columns.push_back(row[k].first);
+						coarse.coefficients.push_back(row[k].second);
+					}
+				}
+				coarse.rowStart.push_back((uint)coarse.columns.size());
+				for (uint e = coarse.rowStart[c]; e < coarse.rowStart[c + 1]; e++) {
+					if (coarse.columns[e] == c) { coarse.diagonal[c] = coarse.coefficients[e]; }
+				}
+			}
+			levels.push_back(move(coarse));
 		}
-		else { // go in the target direction
-			targetPos[dimension] = direction;
-			return parent->children.getValue(targetPos).getBorderLeaves(dimension, !direction, directions);
+		levels.back().aggregates.clear();
+		for (auto& level : levels) {
+			level.x.resize(level.size());
+			level.b.resize(level.size());
+			level.r.resize(level.size());
 		}
 	}
 
-	list<const Node*> getNeighbors(uint dimension, bool direction) const {
-		return getNeighbors(dimension, direction, stack<vector<bool>>());
+	static void multiply(const Level& level, const vector<float>& v, vector<float>& dst) {
+		parallelRange(level.size(), [&](int i) {
+			float sum = 0;
+			for (uint e = level.rowStart[i]; e < level.rowStart[i + 1]; e++) { sum += level.coefficients[e] * v[level.columns[e]]; }
+			dst[i] = sum;
+		});
 	}
 
-	list<const Node*> getLeaves() const {
-		if (isLeaf) { return{ this }; }
-		else {
-			list<const Node*> dst;
-			for (const auto& child : children.values) {
-				dst.merge(child.getLeaves());
-			}
-			return dst;
+	void jacobi(Level& level, uint sweeps) {
+		for (uint s = 0; s < sweeps; s++) {
+			multiply(level, level.x, level.r);
+			parallelRange(level.size(), [&](int i) {
+				level.x[i] += jacobiWeight * (level.b[i] - level.r[i]) / level.diagonal[i];
+			});
 		}
 	}
 
-	void computeNeighbors() {
-
-		if (isLeaf) {
+	// z = V-cycle(r) from 0 : symmetric, so that it can precondition the conjugate gradient
+	void precondition(const vector<float>& res, vector<float>& dst) {
 
+		levels[0].b = res;
+		for (uint l = 0; l + 1 < levels.size(); l++) {
+			Level& fine = levels[l];
+			Level& coarse = levels[l + 1];
+			fill(fine.x.begin(), fine.x.end(), 0.f);
+			jacobi(fine, smoothing);
+			multiply(fine, fine.x, fine.r);
+			fill(coarse.b.begin(), coarse.b.end(), 0.f);
+			for (uint i = 0; i < fine.size(); i++) { coarse.b[fine.aggregates[i]] += fine.b[i] - fine.r[i]; }
 		}
-		else {
-			for (auto& child : children.values) { child.computeNeighbors(); }
+		Level& coarsest = levels.back();
+		fill(coarsest.x.begin(), coarsest.x.end(), 0.f);
+		jacobi(coarsest, levels.size() > 1 ? coarsestSweeps : smoothing);
+		for (int l = (int)levels.size() - 2; l >= 0; l--) {
+			Level& fine = levels[l];
+			const Level& coarse = levels[l + 1];
+			parallelRange(fine.size(), [&](int i) { fine.x[i] += coarse.x[fine.aggregates[i]]; });
+			jacobi(fine, smoothing);
 		}
+		dst = levels[0].x;
 	}
-};
\ No newline at end of file
+};
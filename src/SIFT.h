@@ -1,7 +1,11 @@
 #pragma once
 
 #include <opencv2\opencv.hpp>
-#include <queue>
+#include <opencv2\core\hal\intrin.hpp>
+#include <vector>
+#include <algorithm>
+
+#include "Parallel.h"
 
 using namespace cv;
 using namespace std;
@@ -9,100 +13,342 @@ using namespace std;
 struct SIFT : public Feature2D {
 
 private:
+	// strict total order (ties broken by position), so that the kept points
+	// don't depend on the order in which the tiles are scanned
 	struct KeyPointComparer {
 		bool operator()(const KeyPoint& a, const KeyPoint& b) const {
-			return a.response > b.response;
+			if (a.response != b.response) { return a.response > b.response; }
+			if (a.octave != b.octave) { return a.octave < b.octave; }
+			if (a.pt.y != b.pt.y) { return a.pt.y < b.pt.y; }
+			return a.pt.x < b.pt.x;
 		}
 	};
 
+	// best points found so far, with a separate quota for each cell of a grid
+	// (a single cell keeps the best points of the whole image)
+	// each cell is a heap with the worst point on top, allocated once for quota + 1 points
+	struct KeyPointBuckets {
+		uint cols = 0, rows = 0, quota = 0;
+		float cellW = 1, cellH = 1; // in input image pixels
+		vector<vector<KeyPoint>> heaps;
+		float minResponse = -FLT_MAX; // weaker points are rejected by every cell
+		uint count = 0; // points in all the cells
+
+		void init(uint cols, uint rows, uint quota, int w, int h) {
+			if (cols * rows != heaps.size() || quota != this->quota) {
+				heaps.assign(cols * rows, vector<KeyPoint>());
+				for (auto& heap : heaps) { heap.reserve(quota + 1); }
+			}
+			this->cols = cols;
+			this->rows = rows;
+			this->quota = quota;
+			cellW = (float)w / cols;
+			cellH = (float)h / rows;
+			for (auto& heap : heaps) { heap.clear(); }
+			minResponse = -FLT_MAX;
+			count = 0;
+		}
+
+		uint cellOf(const Point2f& pt) const {
+			uint cx = min(cols - 1, (uint)(pt.x / cellW));
+			uint cy = min(rows - 1, (uint)(pt.y / cellH));
+			return cy * cols + cx;
+		}
+
+		void push(const KeyPoint& point) {
+			auto& heap = heaps[cellOf(point.pt)];
+			if (heap.size() < quota || KeyPointComparer()(point, heap.front())) {
+				heap.push_back(point);
+				push_heap(heap.begin(), heap.end(), KeyPointComparer());
+				if (heap.size() > quota) {
+					pop_heap(heap.begin(), heap.end(), KeyPointComparer());
+					heap.pop_back();
+				}
+				else { count++; }
+				if (heap.size() == quota) { updateMinResponse(); }
+			}
+		}
+
+		void merge(const KeyPointBuckets& other) {
+			for (const auto& heap : other.heaps) {
+				for (const auto& point : heap) { push(point); }
+			}
+		}
+
+		void updateMinResponse() {
+			minResponse = FLT_MAX;
+			for (const auto& heap : heaps) {
+				minResponse = min(minResponse, heap.size() < quota ? -FLT_MAX : heap.front().response);
+			}
+		}
+	};
+
+	// size of the regions scanned at once by detectTile
+	// a row of the tile for every scale of an octave should stay in L1
+	static const int tileWidth = 256, tileHeight = 64;
+
 public:
 	const uint // used for detection
-		sizePyramid = 8,
+		sizePyramid = 3, // number of scales per octave
+		maxOctaves = 8,
 		maxPoints = 256,
 		borderSize = 16; // depends on the descriptor size (in pixels)
+	const float
+		sigma = 1.6f, // blur of the first scale of each octave
+		inputSigma = 0.5f; // blur assumed to be already present in the input image
+
+	// the image is split in gridCols x gridRows cells, each one keeping
+	// its best maxPoints / (gridCols * gridRows) points, to spread the points
+	// (0 counts as 1)
+	uint gridCols = 1, gridRows = 1;
+
+	// the detection stops scanning new tiles once the time budget is spent,
+	// or new octaves once pointBudget points were found (0 for no limit, at most the points kept by the cells)
+	// the result then depends on the speed of the machine
+	double timeBudget = 0; // in milliseconds
+	uint pointBudget = 0;
+
+	// the pyramid is stored as 16 bits fixed point values (8 bits of fraction)
+	// instead of floats, with integer blurs and differences :
+	// half the memory traffic for slightly different points (for 8 bits images)
+	bool fixedPoint = false;
+	static const int fixedShift = 8;
+
+	/*
+		Buffers of the extraction, reused from one frame to the next :
+		once sized for a resolution, detection and description allocate nothing
+		The descriptors given by the workspace versions of compute are rows of a buffer
+		of the workspace, overwritten by the next frame (clone them to keep them)
+		A workspace belongs to a single SIFT and a single thread
+	*/
+	struct Workspace {
+		Size size; // of the images the buffers are allocated for
+		int depth = -1; // of the pyramid, CV_32F or CV_16U
+		Mat grayF, grayU; // grayU is the fixed point input
+		vector<vector<float>> kernels; // blur from one level to the next, [0] for the first level
+		vector<vector<ushort>> kernelsU; // the same ones, as fractions of 2^16
+		vector<vector<Mat>> pyramid; // levels of each octave
+		vector<Mat> blurRows; // horizontal pass of the blur, per octave
+		vector<vector<KeyPointBuckets>> tilePoints; // per octave, per tile
+		vector<vector<float>> tileBuffers; // rolling rows of detectTile, per stripe of tiles
+		KeyPointBuckets cellPoints;
+		Mat maskBits, maskSums; // mask as 0 or 1, and its integral image
+		Mat norms, bins; // gradient maps
+		Mat descriptors;
+	};
 
-	// TODO : mask
 	void detect(InputArray image,
 		std::vector<KeyPoint>& keypoints,
 		InputArray mask = noArray()) {
 
-		// converting to gray scale
-		Mat grayImage;
-		if (image.channels() > 2) { cvtColor(image, grayImage, COLOR_RGB2GRAY); }
-		else { image.copyTo(grayImage); }
+		Workspace workspace;
+		detect(workspace, image, keypoints, mask);
+	}
 
-		Mat grayF; grayImage.convertTo(grayF, CV_32F); // converting to floats
+	void detect(Workspace& workspace, InputArray image,
+		std::vector<KeyPoint>& keypoints,
+		InputArray mask = noArray()) {
 
-													   // pyramid of blurred images
-		vector<Mat> gaussianPyramid;
-		gaussianPyramid.push_back(grayF);
+		toGrayFloat(image, workspace.grayF);
+		detectGray(workspace, workspace.grayF, keypoints, mask);
+	}
 
-		for (uint i = 0; i < sizePyramid; i++) {
-			Mat blurred;
-			GaussianBlur(gaussianPyramid[i], blurred, Size(31, 31), 1);
-			gaussianPyramid.push_back(blurred);
-		}
+	// detection on an image already converted by toGrayFloat
+	void detectGray(const Mat& grayF,
+		std::vector<KeyPoint>& keypoints,
+		InputArray mask = noArray()) {
 
-		// difference between 2 layers
-		// absolute difference, because we detect both maximums and minimums
-		vector<Mat> diffs;
-		for (uint i = 0; i < gaussianPyramid.size() - 1; i++) {
-			diffs.push_back(abs(gaussianPyramid[i + 1] - gaussianPyramid[i]));
+		Workspace workspace;
+		detectGray(workspace, grayF, keypoints, mask);
+	}
+
+	void detectGray(Workspace& ws, const Mat& grayF,
+		std::vector<KeyPoint>& keypoints,
+		InputArray mask = noArray()) {
+
+		int64 deadline = timeBudget > 0 ?
+			getTickCount() + (int64)(timeBudget * 1e-3 * getTickFrequency()) : 0;
+		auto isOutOfTime = [&]() { return deadline != 0 && getTickCount() > deadline; };
+
+		int w = grayF.size().width;
+		int h = grayF.size().height;
+		prepare(ws, grayF.size());
+
+		// whole tiles out of the mask are skipped, with the integral image of the mask
+		// (of 0 and 1, so that its sums can't overflow)
+		Mat maskMat = mask.getMat();
+		if (!maskMat.empty()) {
+			if (maskMat.type() != CV_8UC1 || maskMat.size() != grayF.size()) {
+				cerr << "Error, the mask must be 8 bits and of the size of the image" << endl; throw 1;
+			}
+			threshold(maskMat, ws.maskBits, 0, 1, THRESH_BINARY);
+			integral(ws.maskBits, ws.maskSums, CV_32S);
 		}
 
-		// laplacian of the differences (to get maximums)
-		vector<Mat> diffsLap;
-		float lapArray[] = {
-			0, -1, 0,
-			-1, 4, -1,
-			0, -1, 0
-		};
-		Mat laplacianKernel(3, 3, CV_32FC1, &lapArray);
-		for (uint i = 0; i < diffs.size(); i++) {
-			Mat lap;
-			filter2D(diffs[i], lap, CV_32F, laplacianKernel);
-			diffsLap.push_back(lap);
+		uint cols = max(1u, gridCols), rows = max(1u, gridRows);
+		uint nbCells = cols * rows;
+		uint quota = max(1u, maxPoints / nbCells);
+		ws.cellPoints.init(cols, rows, quota, w, h);
+		// the cells can't keep more points than their quotas
+		uint budget = pointBudget > 0 ? min(pointBudget, nbCells * quota) : 0;
+
+		// first scale of the first octave
+		if (!ws.pyramid.empty()) {
+			if (fixedPoint) {
+				grayF.convertTo(ws.grayU, CV_16U, 1 << fixedShift);
+				blur(ws.grayU, ws.pyramid[0][0], ws.blurRows[0], ws.kernelsU[0]);
+			}
+			else { blur(grayF, ws.pyramid[0][0], ws.blurRows[0], ws.kernels[0]); }
 		}
 
-		KeyPoint a;
-		uint w = grayImage.size().width;
-		uint h = grayImage.size().height;
-		priority_queue<KeyPoint, vector<KeyPoint>, KeyPointComparer> points;
+		for (uint octave = 0; octave < ws.pyramid.size(); octave++) {
 
-		for (uint i = 1; i < diffs.size() - 1; i++) {
+			if (isOutOfTime() || (budget > 0 && ws.cellPoints.count >= budget)) { break; }
 
-			float* dat0 = (float*)diffsLap[i - 1].data;
-			float* dat1 = (float*)diffsLap[i].data;
-			float* dat2 = (float*)diffsLap[i + 1].data;
+			int scale = 1 << octave; // size of an octave pixel in the input image
+			vector<Mat>& gaussianPyramid = ws.pyramid[octave];
 
-			for (uint y = borderSize + 1; y < h - borderSize - 1; y++) {
-				for (uint x = borderSize + 1; x < w - borderSize - 1; x++) {
+			// the octave starts from the scale with twice the blur of the first one of the previous octave
+			if (octave > 0) {
+				if (fixedPoint) { downsample<ushort>(ws.pyramid[octave - 1][sizePyramid], gaussianPyramid[0]); }
+				else { downsample<float>(ws.pyramid[octave - 1][sizePyramid], gaussianPyramid[0]); }
+			}
 
-					float pBefore = dat0[y*w + x];
-					float p = dat1[y*w + x];
-					float pAfter = dat2[y*w + x];
-					if (p > pBefore && p > pAfter) {
+			// pyramid of blurred images
+			for (uint i = 1; i < gaussianPyramid.size(); i++) {
+				if (fixedPoint) { blur(gaussianPyramid[i - 1], gaussianPyramid[i], ws.blurRows[octave], ws.kernelsU[i]); }
+				else { blur(gaussianPyramid[i - 1], gaussianPyramid[i], ws.blurRows[octave], ws.kernels[i]); }
+			}
 
-						// TODO : eliminate borders, keep corners only
-						// TODO : give more informations to the point
-						KeyPoint point;
-						point.pt.x = (float)x;
-						point.pt.y = (float)y;
-						point.octave = i;
-						point.response = 2 * p - pBefore - pAfter;
-						
-						points.push(point);
-						if (points.size() > maxPoints) { points.pop(); }
+			// the tiles are scanned in parallel, each one keeping its own best points
+			// the tiling doesn't depend on the number of threads, so neither does the result
+			int xMin, yMin, xMax, yMax, nbTilesX;
+			octaveRegion(octave, gaussianPyramid[0].size(), grayF.size(), xMin, yMin, xMax, yMax, nbTilesX);
+			auto& tilePoints = ws.tilePoints[octave];
+			for (auto& points : tilePoints) { points.init(cols, rows, quota, w, h); }
+
+			int nbStripes = (int)ws.tileBuffers.size(); // one buffer per stripe of tiles
+			parallelFor(Range(0, nbStripes), [&](const Range& range) {
+				for (int stripe = range.start; stripe < range.end; stripe++) {
+					for (int tile = stripe; tile < (int)tilePoints.size(); tile += nbStripes) {
+						int x0 = xMin + (tile % nbTilesX) * tileWidth;
+						int y0 = yMin + (tile / nbTilesX) * tileHeight;
+						int x1 = min(x0 + tileWidth, xMax);
+						int y1 = min(y0 + tileHeight, yMax);
+						if (isOutOfTime()) { return; }
+						if (!maskMat.empty()) {
+							const Mat& sums = ws.maskSums;
+							int bx0 = x0 * scale, by0 = y0 * scale;
+							int bx1 = min(x1 * scale, w), by1 = min(y1 * scale, h);
+							int sum = sums.at<int>(by1, bx1) - sums.at<int>(by0, bx1)
+								- sums.at<int>(by1, bx0) + sums.at<int>(by0, bx0);
+							if (sum == 0) { continue; }
+						}
+						detectTile(gaussianPyramid, octave, x0, x1, y0, y1,
+							ws.tileBuffers[stripe].data(), maskMat, tilePoints[tile]);
 					}
 				}
-			}
+			}, nbStripes);
+
+			// the global best points of a cell are among the best points of each tile in this cell
+			for (const auto& points : tilePoints) { ws.cellPoints.merge(points); }
 		}
 
 		keypoints.clear();
-		while (points.size() > 0) {
-			keypoints.push_back(points.top());
-			points.pop();
+		for (const auto& heap : ws.cellPoints.heaps) {
+			keypoints.insert(keypoints.end(), heap.begin(), heap.end());
 		}
+		sort(keypoints.begin(), keypoints.end(), KeyPointComparer());
+	}
+
+	static void toGrayFloat(InputArray image, Mat& grayF) {
+
+		Mat src = image.getMat();
+		grayF.create(src.size(), CV_32F);
+
+		if (src.channels() > 2 && src.depth() == CV_8U) {
+			// converting to gray scale and to floats at once
+			int cn = src.channels();
+			for (int y = 0; y < src.rows; y++) {
+				const uchar* pix = src.ptr<uchar>(y);
+				float* dst = grayF.ptr<float>(y);
+				for (int x = 0; x < src.cols; x++, pix += cn) {
+					dst[x] = 0.299f * pix[0] + 0.587f * pix[1] + 0.114f * pix[2]; // as COLOR_RGB2GRAY
+				}
+			}
+		}
+		else if (src.channels() > 2) {
+			Mat grayImage;
+			cvtColor(src, grayImage, COLOR_RGB2GRAY);
+			grayImage.convertTo(grayF, CV_32F);
+		}
+		else { src.convertTo(grayF, CV_32F); }
+	}
+
+	/*
+		norm and orientation bin of the gradient of every pixel,
+		computed once per image and shared by all the descriptors
+		(the last row and column have no gradient)
+	*/
+	static void computeGradientMaps(const Mat& grayF, Mat& norms, Mat& bins) {
+
+		int w = grayF.size().width;
+		int h = grayF.size().height;
+		norms.create(h, w, CV_32F);
+		bins.create(h, w, CV_8U);
+
+		parallelFor(Range(0, h), [&](const Range& range) {
+			for (int y = range.start; y < range.end; y++) {
+				float* norm = norms.ptr<float>(y);
+				uchar* bin = bins.ptr<uchar>(y);
+				if (y == h - 1) {
+					for (int x = 0; x < w; x++) { norm[x] = 0; bin[x] = 0; }
+					continue;
+				}
+				const float* p = grayF.ptr<float>(y);
+				const float* below = grayF.ptr<float>(y + 1);
+
+				int x = 0;
+#if CV_SIMD128
+				// the bin only depends on signs and comparisons, no atan2 needed
+				v_float32x4 zero = v_setzero_f32();
+				for (; x <= w - 1 - 4; x += 4) {
+					v_float32x4 v = v_load(p + x);
+					v_float32x4 gradX = v_load(below + x) - v;
+					v_float32x4 gradY = v_load(p + x + 1) - v;
+					v_store(norm + x, v_sqrt(gradX * gradX + gradY * gradY));
+
+					v_float32x4 neg = gradY < zero;
+					v_float32x4 gx = v_select(neg, zero - gradX, gradX);
+					v_float32x4 gy = v_select(neg, zero - gradY, gradY);
+					v_float32x4 sub = v_select(gx > zero,
+						v_select(gy < gx, v_setall_f32(0), v_setall_f32(1)),
+						v_select(gy > zero - gx, v_setall_f32(2), v_setall_f32(3)));
+					int values[4];
+					v_store(values, v_round(sub + v_select(neg, zero, v_setall_f32(4))));
+					for (int i = 0; i < 4; i++) { bin[x + i] = (uchar)values[i]; }
+				}
+#endif
+				for (; x < w - 1; x++) {
+					float gradX = below[x] - p[x];
+					float gradY = p[x + 1] - p[x];
+					norm[x] = sqrt(gradX*gradX + gradY*gradY);
+					bin[x] = angleBin(gradX, gradY);
+				}
+				norm[w - 1] = 0;
+				bin[w - 1] = 0;
+			}
+		});
+	}
+
+	// bin of atan2(gradY, gradX) among 8 bins from -pi to pi
+	static uchar angleBin(float gradX, float gradY) {
+		// angles in [-pi, 0) are the angles of the opposite vector in [0, pi), minus pi
+		bool neg = gradY < 0;
+		float gx = neg ? -gradX : gradX;
+		float gy = neg ? -gradY : gradY;
+		int sub = gx > 0 ? (gy < gx ? 0 : 1) : (gy > -gx ? 2 : 3); // quarter of [0, pi)
+		return (uchar)(sub + (neg ? 0 : 4));
 	}
 
 	/*
@@ -114,76 +360,475 @@ public:
 		CV_OUT CV_IN_OUT std::vector<KeyPoint>& keypoints,
 		Mat& descriptors) {
 
-		Mat srcF;
-		image.convertTo(srcF, CV_32F);
-		if (srcF.channels() > 2) { cvtColor(srcF, srcF, COLOR_RGB2GRAY); } // TODO : useless ?
+		Workspace workspace;
+		compute(workspace, image, keypoints, descriptors);
+	};
+
+	void compute(Workspace& workspace, const Mat& image,
+		std::vector<KeyPoint>& keypoints,
+		Mat& descriptors) {
+
+		toGrayFloat(image, workspace.grayF);
+		computeGray(workspace, workspace.grayF, keypoints, descriptors);
+	}
 
-		descriptors = Mat(Size(128, keypoints.size()), CV_8UC1); // each line is a point
-		uchar* descPixels = (uchar*)descriptors.data;
+	// descriptors of an image already converted by toGrayFloat
+	void computeGray(const Mat& grayF,
+		std::vector<KeyPoint>& keypoints,
+		Mat& descriptors) const {
 
-		float* pixels = (float*)srcF.data;
-		uint w = srcF.size().width;
-		uint h = srcF.size().height;
+		Workspace workspace;
+		computeGray(workspace, grayF, keypoints, descriptors);
+	}
 
-		for (uint line = 0; line < keypoints.size(); line++) {
+	void computeGray(Workspace& ws, const Mat& grayF,
+		std::vector<KeyPoint>& keypoints,
+		Mat& descriptors) const {
 
-			Point2f& pt = keypoints[line].pt;
-			for (int regYi = 0; regYi < 4; regYi++) {
-				uint y0 = (uint)pt.y + 4 * (regYi - 2);
+		computeGradientMaps(grayF, ws.norms, ws.bins);
 
-				for (int regXi = 0; regXi < 4; regXi++) {
-					uint x0 = (uint)pt.x + 4 * (regXi - 2);
+		// each line is a point
+		if (ws.descriptors.rows < (int)keypoints.size()) {
+			ws.descriptors.create(max((int)maxPoints, (int)keypoints.size()), 128, CV_8UC1);
+		}
+		descriptors = ws.descriptors.rowRange(0, (int)keypoints.size());
 
-					float values[8]; // histogram
-					for (uint i = 0; i < 8; i++) { values[i] = 0; }
-					for (uint y = y0; y < y0 + 4; y++) {
-						for (uint x = x0; x < x0 + 4; x++) {
+		// the descriptors are independent from each other
+		parallelFor(Range(0, (int)keypoints.size()), [&](const Range& range) {
+			for (int line = range.start; line < range.end; line++) {
+				computeDescriptor(ws.norms, ws.bins, keypoints[line].pt, descriptors.ptr<uchar>(line));
+			}
+		});
+	}
 
-							float p = pixels[y*w + x];
-							float gradX = pixels[(y + 1)*w + (x + 0)] - p;
-							float gradY = pixels[(y + 0)*w + (x + 1)] - p;
+	static void computeDescriptor(const Mat& norms, const Mat& bins, const Point2f& pt, uchar* desc) {
 
-							float norm = sqrt(gradX*gradX + gradY*gradY);
-							float angle = atan2(gradY, gradX);
-							int bin = (int)((angle + 3.1416f) * 8);
+		uint w = norms.size().width;
+		uint h = norms.size().height;
 
-							// TODO : weighted by the distance from the keyPoint center
-							//float distX = pt.x - x;
-							//float distY = pt.y - y;
+		for (int regYi = 0; regYi < 4; regYi++) {
+			uint y0 = (uint)pt.y + 4 * (regYi - 2);
 
-							values[max(0, min(8 - 1, bin))] += norm;
-						}
-					}
+			for (int regXi = 0; regXi < 4; regXi++) {
+				uint x0 = (uint)pt.x + 4 * (regXi - 2);
 
-					// TODO : shift and normalize the histogram to its center ?
-					uint maxPos;
-					float maxValue = 0;
-					for (uint i = 0; i < 8; i++) {
-						if (values[i] > maxValue) {
-							maxPos = i;
-							maxValue = values[i];
-						}
-					}
-					float shiftedValues[8];
-					for (uint i = 0; i < 8; i++) {
-						shiftedValues[i] = values[(i + maxPos) % 8] / maxValue;
+				float values[8]; // histogram
+				for (uint i = 0; i < 8; i++) { values[i] = 0; }
+				for (uint y = y0; y < y0 + 4; y++) {
+					if (y >= h) { continue; } // outside of the image (also catches negative values)
+					const float* normRow = norms.ptr<float>(y);
+					const uchar* binRow = bins.ptr<uchar>(y);
+					for (uint x = x0; x < x0 + 4; x++) {
+						if (x >= w) { continue; }
+
+						// TODO : weighted by the distance from the keyPoint center
+						values[binRow[x]] += normRow[x];
 					}
+				}
 
-					uchar* descPos = descPixels + (line * 128 + (regYi * 4 + regXi) * 8);
-					for (uint i = 0; i < 8; i++) {
-						descPos[i] = (uchar)(255 * shiftedValues[i]);
+				// TODO : shift and normalize the histogram to its center ?
+				uint maxPos = 0;
+				float maxValue = 0;
+				for (uint i = 0; i < 8; i++) {
+					if (values[i] > maxValue) {
+						maxPos = i;
+						maxValue = values[i];
 					}
 				}
+
+				uchar* descPos = desc + (regYi * 4 + regXi) * 8;
+				for (uint i = 0; i < 8; i++) {
+					descPos[i] = maxValue > 0 ? (uchar)(255 * values[(i + maxPos) % 8] / maxValue) : 0;
+				}
 			}
 		}
-	};
+	}
 
 	void detectAndCompute(const Mat& image, InputArray mask,
 		std::vector<KeyPoint>& keypoints,
 		Mat& descriptors,
 		bool useProvidedKeypoints = false) {
 
-		detect(image, keypoints, mask);
-		compute(image, keypoints, descriptors);
+		Workspace workspace;
+		detectAndCompute(workspace, image, mask, keypoints, descriptors, useProvidedKeypoints);
+	}
+
+	void detectAndCompute(Workspace& workspace, const Mat& image, InputArray mask,
+		std::vector<KeyPoint>& keypoints,
+		Mat& descriptors,
+		bool useProvidedKeypoints = false) {
+
+		// the image is converted only once for both steps
+		toGrayFloat(image, workspace.grayF);
+		if (!useProvidedKeypoints) { detectGray(workspace, workspace.grayF, keypoints, mask); }
+		computeGray(workspace, workspace.grayF, keypoints, descriptors);
+	}
+
+private:
+	// (re)allocates the buffers of the workspace when the image size changes
+	void prepare(Workspace& ws, Size size) const {
+
+		if (ws.kernels.size() != sizePyramid + 3) {
+			// incremental blurs between 2 scales of an octave
+			// (blurring a sigma1 image by sqrt(sigma2^2 - sigma1^2) gives a sigma2 image)
+			ws.kernels.resize(sizePyramid + 3);
+			gaussianKernel(sqrt(sigma*sigma - inputSigma*inputSigma), ws.kernels[0]);
+			float k = pow(2.f, 1.f / sizePyramid);
+			for (uint i = 1; i < ws.kernels.size(); i++) {
+				float sigPrev = sigma * pow(k, (float)(i - 1));
+				float sigNext = sigPrev * k;
+				gaussianKernel(sqrt(sigNext*sigNext - sigPrev*sigPrev), ws.kernels[i]);
+			}
+			ws.kernelsU.resize(ws.kernels.size());
+			for (uint i = 0; i < ws.kernels.size(); i++) { fixedPointKernel(ws.kernels[i], ws.kernelsU[i]); }
+		}
+
+		uint nbStripes = max(1, getNumThreads());
+		if (ws.tileBuffers.size() != nbStripes) {
+			ws.tileBuffers.assign(nbStripes, vector<float>(4 * (sizePyramid + 2) * (tileWidth + 2)));
+		}
+
+		int depth = fixedPoint ? CV_16U : CV_32F;
+		if (ws.size == size && ws.depth == depth) { return; }
+		ws.size = size;
+		ws.depth = depth;
+		if (fixedPoint) { ws.grayU.create(size, CV_16U); }
+		ws.pyramid.clear();
+		ws.blurRows.clear();
+		ws.tilePoints.clear();
+
+		Size octaveSize = size;
+		for (uint octave = 0; octave < maxOctaves; octave++) {
+			int xMin, yMin, xMax, yMax, nbTilesX;
+			if (!octaveRegion(octave, octaveSize, size, xMin, yMin, xMax, yMax, nbTilesX)) { break; }
+			int nbTilesY = (yMax - yMin + tileHeight - 1) / tileHeight;
+
+			ws.pyramid.push_back(vector<Mat>(sizePyramid + 3));
+			for (auto& level : ws.pyramid.back()) { level.create(octaveSize, depth); }
+			ws.blurRows.push_back(Mat(octaveSize, depth));
+			ws.tilePoints.push_back(vector<KeyPointBuckets>(nbTilesX * nbTilesY));
+
+			octaveSize = Size(octaveSize.width / 2, octaveSize.height / 2);
+		}
+
+		ws.descriptors.create(maxPoints, 128, CV_8UC1);
+	}
+
+	// region of an octave where points can be detected,
+	// far enough from the borders of the input image for the descriptors
+	bool octaveRegion(uint octave, Size octaveSize, Size size,
+		int& xMin, int& yMin, int& xMax, int& yMax, int& nbTilesX) const {
+
+		int scale = 1 << octave; // size of an octave pixel in the input image
+		xMin = max(1, (int)(borderSize + scale) / scale);
+		yMin = max(1, (int)(borderSize + scale) / scale);
+		xMax = min(octaveSize.width - 1, (size.width - (int)borderSize + scale - 2) / scale);
+		yMax = min(octaveSize.height - 1, (size.height - (int)borderSize + scale - 2) / scale);
+		nbTilesX = (xMax - xMin + tileWidth - 1) / tileWidth;
+		return xMin < xMax && yMin < yMax;
+	}
+
+	// same size as the kernels of GaussianBlur for floats
+	static void gaussianKernel(float sig, vector<float>& kernel) {
+		int radius = max(1, cvRound(4 * sig));
+		kernel.resize(2 * radius + 1);
+		float sum = 0;
+		for (int i = -radius; i <= radius; i++) {
+			kernel[i + radius] = exp(-(i * i) / (2 * sig * sig));
+			sum += kernel[i + radius];
+		}
+		for (auto& value : kernel) { value /= sum; }
+	}
+
+	// separable gaussian blur, with the borders reflected like GaussianBlur
+	// horizontal pass by bands of rows in parallel, then vertical pass
+	static void blur(const Mat& src, Mat& dst, Mat& tmp, const vector<float>& kernel) {
+
+		int w = src.size().width;
+		int h = src.size().height;
+		int radius = (int)kernel.size() / 2;
+		const float* k = kernel.data() + radius; // from k[-radius] to k[radius]
+		int nbBands = (h + tileHeight - 1) / tileHeight;
+
+		// columns far enough from the borders to skip the reflection
+		int xs = min(radius, w), xe = max(xs, w - radius);
+
+		parallelFor(Range(0, nbBands), [&](const Range& range) {
+			for (int y = range.start * tileHeight; y < min(range.end * tileHeight, h); y++) {
+				const float* s = src.ptr<float>(y);
+				float* t = tmp.ptr<float>(y);
+				auto borderPixel = [&](int x) {
+					float sum = 0;
+					for (int j = -radius; j <= radius; j++) {
+						sum += k[j] * s[borderInterpolate(x + j, w, BORDER_REFLECT_101)];
+					}
+					t[x] = sum;
+				};
+				for (int x = 0; x < xs; x++) { borderPixel(x); }
+				int x = xs;
+#if CV_SIMD128
+				for (; x <= xe - 4; x += 4) {
+					v_float32x4 sum = v_setzero_f32();
+					for (int j = -radius; j <= radius; j++) {
+						sum += v_setall_f32(k[j]) * v_load(s + x + j);
+					}
+					v_store(t + x, sum);
+				}
+#endif
+				for (; x < xe; x++) {
+					float sum = 0;
+					for (int j = -radius; j <= radius; j++) { sum += k[j] * s[x + j]; }
+					t[x] = sum;
+				}
+				for (x = xe; x < w; x++) { borderPixel(x); }
+			}
+		});
+
+		parallelFor(Range(0, nbBands), [&](const Range& range) {
+			for (int y = range.start * tileHeight; y < min(range.end * tileHeight, h); y++) {
+				float* d = dst.ptr<float>(y);
+				for (int j = -radius; j <= radius; j++) {
+					const float* t = tmp.ptr<float>(borderInterpolate(y + j, h, BORDER_REFLECT_101));
+					float kj = k[j];
+					int x = 0;
+#if CV_SIMD128
+					v_float32x4 vk = v_setall_f32(kj);
+					if (j == -radius) { for (; x <= w - 4; x += 4) { v_store(d + x, vk * v_load(t + x)); } }
+					else { for (; x <= w - 4; x += 4) { v_store(d + x, v_load(d + x) + vk * v_load(t + x)); } }
+#endif
+					if (j == -radius) { for (; x < w; x++) { d[x] = kj * t[x]; } }
+					else { for (; x < w; x++) { d[x] += kj * t[x]; } }
+				}
+			}
+		});
+	}
+
+	// weights as fractions of 2^16, rounded so that their sum stays exactly 1
+	static void fixedPointKernel(const vector<float>& kernel, vector<ushort>& kernelU) {
+		int radius = (int)kernel.size() / 2;
+		kernelU.resize(kernel.size());
+		int sum = 0;
+		for (uint i = 0; i < kernel.size(); i++) {
+			kernelU[i] = (ushort)cvRound(kernel[i] * 65536);
+			if ((int)i != radius) { sum += kernelU[i]; }
+		}
+		kernelU[radius] = (ushort)(65536 - sum); // the center weight is below 1
+	}
+
+	// same blur on 16 bits values, accumulated on 32 bits
+	// (the weights sum to 2^16, so the sums fit)
+	static void blur(const Mat& src, Mat& dst, Mat& tmp, const vector<ushort>& kernel) {
+
+		int w = src.size().width;
+		int h = src.size().height;
+		int radius = (int)kernel.size() / 2;
+		const ushort* k = kernel.data() + radius;
+		int nbBands = (h + tileHeight - 1) / tileHeight;
+		int xs = min(radius, w), xe = max(xs, w - radius);
+
+		parallelFor(Range(0, nbBands), [&](const Range& range) {
+			for (int y = range.start * tileHeight; y < min(range.end * tileHeight, h); y++) {
+				const ushort* s = src.ptr<ushort>(y);
+				ushort* t = tmp.ptr<ushort>(y);
+				auto borderPixel = [&](int x) {
+					uint sum = 1 << 15;
+					for (int j = -radius; j <= radius; j++) {
+						sum += k[j] * (uint)s[borderInterpolate(x + j, w, BORDER_REFLECT_101)];
+					}
+					t[x] = (ushort)(sum >> 16);
+				};
+				for (int x = 0; x < xs; x++) { borderPixel(x); }
+				int x = xs;
+#if CV_SIMD128
+				// 8 pixels at once, twice the lanes of the floats
+				for (; x <= xe - 8; x += 8) {
+					v_uint32x4 sumLo = v_setzero_u32(), sumHi = v_setzero_u32();
+					for (int j = -radius; j <= radius; j++) {
+						v_uint32x4 lo, hi;
+						v_mul_expand(v_setall_u16(k[j]), v_load(s + x + j), lo, hi);
+						sumLo += lo;
+						sumHi += hi;
+					}
+					v_store(t + x, v_rshr_pack<16>(sumLo, sumHi));
+				}
+#endif
+				for (; x < xe; x++) {
+					uint sum = 1 << 15;
+					for (int j = -radius; j <= radius; j++) { sum += k[j] * (uint)s[x + j]; }
+					t[x] = (ushort)(sum >> 16);
+				}
+				for (x = xe; x < w; x++) { borderPixel(x); }
+			}
+		});
+
+		// the sums of a row are kept in registers, there is no 32 bits row to accumulate into
+		parallelFor(Range(0, nbBands), [&](const Range& range) {
+			for (int y = range.start * tileHeight; y < min(range.end * tileHeight, h); y++) {
+				ushort* d = dst.ptr<ushort>(y);
+				int x = 0;
+#if CV_SIMD128
+				for (; x <= w - 8; x += 8) {
+					v_uint32x4 sumLo = v_setzero_u32(), sumHi = v_setzero_u32();
+					for (int j = -radius; j <= radius; j++) {
+						const ushort* t = tmp.ptr<ushort>(borderInterpolate(y + j, h, BORDER_REFLECT_101));
+						v_uint32x4 lo, hi;
+						v_mul_expand(v_setall_u16(k[j]), v_load(t + x), lo, hi);
+						sumLo += lo;
+						sumHi += hi;
+					}
+					v_store(d + x, v_rshr_pack<16>(sumLo, sumHi));
+				}
+#endif
+				for (; x < w; x++) {
+					uint sum = 1 << 15;
+					for (int j = -radius; j <= radius; j++) {
+						sum += k[j] * (uint)tmp.ptr<ushort>(borderInterpolate(y + j, h, BORDER_REFLECT_101))[x];
+					}
+					d[x] = (ushort)(sum >> 16);
+				}
+			}
+		});
+	}
+
+	// one pixel out of 2 in each direction
+	template<typename T>
+	static void downsample(const Mat& src, Mat& dst) {
+		for (int y = 0; y < dst.rows; y++) {
+			const T* s = src.ptr<T>(2 * y);
+			T* d = dst.ptr<T>(y);
+			for (int x = 0; x < dst.cols; x++) { d[x] = s[2 * x]; }
+		}
+	}
+
+	// absolute difference of 2 fixed point levels, back to the scale of the floats
+	static void computeDiffRowU(const vector<Mat>& gaussianPyramid, uint i, int y, int x0, int tw, float* dst) {
+		const ushort* g0 = gaussianPyramid[i].ptr<ushort>(y) + x0 - 1;
+		const ushort* g1 = gaussianPyramid[i + 1].ptr<ushort>(y) + x0 - 1;
+		const float invScale = 1.f / (1 << fixedShift);
+		int x = 0;
+#if CV_SIMD128
+		v_float32x4 vScale = v_setall_f32(invScale);
+		for (; x <= tw - 8; x += 8) {
+			v_uint32x4 lo, hi;
+			v_expand(v_absdiff(v_load(g1 + x), v_load(g0 + x)), lo, hi);
+			v_store(dst + x, v_cvt_f32(v_reinterpret_as_s32(lo)) * vScale);
+			v_store(dst + x + 4, v_cvt_f32(v_reinterpret_as_s32(hi)) * vScale);
+		}
+#endif
+		for (; x < tw; x++) { dst[x] = std::abs((int)g1[x] - (int)g0[x]) * invScale; }
+	}
+
+	// scans the [x0,x1)x[y0,y1) region of an octave in a single pass :
+	// the differences of gaussians, their absolute value, their laplacian
+	// and the extremum test across scales are computed row by row
+	// in rolling buffers instead of full images
+	void detectTile(const vector<Mat>& gaussianPyramid, uint octave,
+		int x0, int x1, int y0, int y1,
+		float* buffer, // 4 * (x1 - x0 + 2) floats per difference
+		const Mat& mask, // empty, or 8 bits in input image coordinates
+		KeyPointBuckets& points) const {
+
+		const uint nbDiffs = (uint)gaussianPyramid.size() - 1;
+		const int tw = x1 - x0 + 2; // 1 pixel of margin on each side for the laplacian
+		const int n = x1 - x0;
+		const int scale = 1 << octave;
+		const float k = pow(2.f, 1.f / sizePyramid);
+
+		// 3 rows of differences (the row y is in the slot y % 3) and 1 row of laplacian per difference
+		auto diffRow = [&](uint i, int y) { return buffer + (4 * i + y % 3) * tw; };
+		auto lapRow = [&](uint i) { return buffer + (4 * i + 3) * tw; };
+
+		// absolute difference, because we detect both maximums and minimums
+		auto computeDiffRow = [&](uint i, int y) {
+			if (gaussianPyramid[i].depth() == CV_16U) {
+				computeDiffRowU(gaussianPyramid, i, y, x0, tw, diffRow(i, y));
+				return;
+			}
+			const float* g0 = gaussianPyramid[i].ptr<float>(y) + x0 - 1;
+			const float* g1 = gaussianPyramid[i + 1].ptr<float>(y) + x0 - 1;
+			float* dst = diffRow(i, y);
+			int x = 0;
+#if CV_SIMD128
+			for (; x <= tw - 4; x += 4) {
+				v_store(dst + x, v_absdiff(v_load(g1 + x), v_load(g0 + x)));
+			}
+#endif
+			for (; x < tw; x++) { dst[x] = std::abs(g1[x] - g0[x]); }
+		};
+
+		for (uint i = 0; i < nbDiffs; i++) {
+			computeDiffRow(i, y0 - 1);
+			computeDiffRow(i, y0);
+		}
+
+		for (int y = y0; y < y1; y++) {
+
+			// laplacian of the differences (to get maximums)
+			for (uint i = 0; i < nbDiffs; i++) {
+				computeDiffRow(i, y + 1);
+
+				const float* u = diffRow(i, y - 1) + 1;
+				const float* c = diffRow(i, y) + 1;
+				const float* d = diffRow(i, y + 1) + 1;
+				float* lap = lapRow(i);
+				int x = 0;
+#if CV_SIMD128
+				v_float32x4 four = v_setall_f32(4);
+				for (; x <= n - 4; x += 4) {
+					v_float32x4 v = four * v_load(c + x)
+						- v_load(c + x - 1) - v_load(c + x + 1)
+						- v_load(u + x) - v_load(d + x);
+					v_store(lap + x, v);
+				}
+#endif
+				for (; x < n; x++) { lap[x] = 4 * c[x] - c[x - 1] - c[x + 1] - u[x] - d[x]; }
+			}
+
+			// maximums across scales
+			for (uint i = 1; i < nbDiffs - 1; i++) {
+
+				const float* dat0 = lapRow(i - 1);
+				const float* dat1 = lapRow(i);
+				const float* dat2 = lapRow(i + 1);
+
+				auto testPoint = [&](int x) {
+					float pBefore = dat0[x];
+					float p = dat1[x];
+					float pAfter = dat2[x];
+					if (p > pBefore && p > pAfter && p + p - pBefore - pAfter >= points.minResponse &&
+						(mask.empty() || mask.at<uchar>(y * scale, (x0 + x) * scale) != 0)) {
+
+						// TODO : eliminate borders, keep corners only
+						KeyPoint point;
+						point.pt.x = (float)((x0 + x) * scale);
+						point.pt.y = (float)(y * scale);
+						point.octave = octave + (i << 8); // octave and scale inside the octave
+						point.size = 2 * sigma * pow(k, (float)i) * scale;
+						point.response = 2 * p - pBefore - pAfter;
+
+						points.push(point);
+					}
+				};
+
+				int x = 0;
+#if CV_SIMD128
+				// most candidates are weaker than the current worst point
+				// and are rejected 4 at a time
+				for (; x <= n - 4; x += 4) {
+					v_float32x4 pBefore = v_load(dat0 + x);
+					v_float32x4 p = v_load(dat1 + x);
+					v_float32x4 pAfter = v_load(dat2 + x);
+					v_float32x4 minResponse = v_setall_f32(points.minResponse);
+					v_float32x4 isCandidate = (p > pBefore) & (p > pAfter) &
+						((p + p - pBefore - pAfter) >= minResponse);
+					int candidates = v_signmask(isCandidate);
+					for (int lane = 0; candidates != 0; lane++, candidates >>= 1) {
+						if (candidates & 1) { testPoint(x + lane); }
+					}
+				}
+#endif
+				for (; x < n; x++) { testPoint(x); }
+			}
+		}
 	}
-};
\ No newline at end of file
+};
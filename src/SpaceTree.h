@@ -0,0 +1,469 @@
+#pragma once
+
+#include <opencv2\opencv.hpp>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+#include <iostream>
+
+#include "Parallel.h"
+
+using namespace std;
+
+/*
+	Interleaving of the bits of the coordinates of a cell (Morton code) :
+	the bit b of the coordinate d goes to the bit b * dimensions + d of the code.
+	The generic version moves one bit at a time, 2D and 3D use masks.
+*/
+template<uint dimensions>
+struct Morton {
+	static_assert(dimensions > 0, "a tree needs at least one dimension");
+	// per coordinate, at most the 31 bits of the cell coordinates (computed with 1u << bits)
+	static const uint bits = 63 / dimensions < 31 ? 63 / dimensions : 31;
+
+	static uint64_t spread(uint32_t v) {
+		uint64_t x = 0;
+		for (uint b = 0; b < bits; b++) { x |= (uint64_t)((v >> b) & 1) << (b * dimensions); }
+		return x;
+	}
+
+	static uint32_t compact(uint64_t x) {
+		uint32_t v = 0;
+		for (uint b = 0; b < bits; b++) { v |= (uint32_t)((x >> (b * dimensions)) & 1) << b; }
+		return v;
+	}
+};
+
+template<>
+struct Morton<2> {
+	static const uint bits = 31;
+
+	static uint64_t spread(uint32_t v) {
+		uint64_t x = v;
+		x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+		x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+		x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+		x = (x | (x << 2)) & 0x3333333333333333ull;
+		x = (x | (x << 1)) & 0x5555555555555555ull;
+		return x;
+	}
+
+	static uint32_t compact(uint64_t x) {
+		x &= 0x5555555555555555ull;
+		x = (x | (x >> 1)) & 0x3333333333333333ull;
+		x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0Full;
+		x = (x | (x >> 4)) & 0x00FF00FF00FF00FFull;
+		x = (x | (x >> 8)) & 0x0000FFFF0000FFFFull;
+		x = (x | (x >> 16)) & 0x00000000FFFFFFFFull;
+		return (uint32_t)x;
+	}
+};
+
+template<>
+struct Morton<3> {
+	static const uint bits = 21;
+
+	static uint64_t spread(uint32_t v) {
+		uint64_t x = v & 0x1FFFFF;
+		x = (x | (x << 32)) & 0x001F00000000FFFFull;
+		x = (x | (x << 16)) & 0x001F0000FF0000FFull;
+		x = (x | (x << 8)) & 0x100F00F00F00F00Full;
+		x = (x | (x << 4)) & 0x10C30C30C30C30C3ull;
+		x = (x | (x << 2)) & 0x1249249249249249ull;
+		return x;
+	}
+
+	static uint32_t compact(uint64_t x) {
+		x &= 0x1249249249249249ull;
+		x = (x | (x >> 2)) & 0x10C30C30C30C30C3ull;
+		x = (x | (x >> 4)) & 0x100F00F00F00F00Full;
+		x = (x | (x >> 8)) & 0x001F0000FF0000FFull;
+		x = (x | (x >> 16)) & 0x001F00000000FFFFull;
+		x = (x | (x >> 32)) & 0x00000000001FFFFFull;
+		return (uint32_t)x;
+	}
+};
+
+/*
+	Linear tree over points in any dimension (quadtree in 2D, octree in 3D) :
+	only the leaves are stored, in one array sorted by Morton code (the order of a depth first traversal),
+	with the points of each leaf in a CSR side array.
+	A cell of level l is one of the 2^l parts of the box along each dimension, and its code is
+	the Morton code of its first corner at the deepest level : the child index of a cell is the
+	dimensions bits of its level in the code, the leaves inside a cell are contiguous,
+	and the leaf containing a point is found by a binary search.
+	A leaf holds at most leafCapacity points, unless it is at the maximum depth.
+	The tree is built in bulk, in parallel and without going down the tree : the codes of the points
+	are radix sorted, the level of the leaf of each point comes from the codes of its neighbors
+	in that order, and the empty leaves fill the gaps between the others.
+	The structure only depends on the positions of the points, not on their order.
+	The dimension is a template parameter : the number of children and of sides of a cell,
+	and the Morton encoding are known at compile time.
+*/
+template<uint dimensions>
+struct SpaceTree {
+
+	static const uint nbChildren = 1 << dimensions;
+	static const uint nbSides = 2 * dimensions; // a side per direction of each dimension
+	static const uint maxLevels = Morton<dimensions>::bits;
+
+	typedef cv::Vec<float, dimensions> Point;
+	typedef array<uint32_t, dimensions> Cell; // coordinates in cells of the deepest level
+
+	struct Leaf {
+		uint64_t code; // Morton code of the first corner, at the deepest level
+		uint32_t level;
+	};
+
+	Point origin, extent; // box of the tree
+	uint maxDepth;
+	uint leafCapacity; // points in a leaf above the maximum depth
+	vector<Leaf> leaves;
+	vector<uint> pointStart; // points of the leaf i : pointIndices[pointStart[i]] to pointIndices[pointStart[i+1]-1]
+	vector<uint> pointIndices;
+
+	SpaceTree(const Point& origin, const Point& extent, uint maxDepth, uint leafCapacity) :
+		origin(origin), extent(extent), maxDepth(maxDepth), leafCapacity(std::max(1u, leafCapacity)) {
+
+		if (maxDepth > maxLevels) { cerr << "Error, a tree in " << dimensions << "D can't be deeper than " << maxLevels << endl; throw 1; }
+	}
+
+	// the position of the point i is position(i)
+	template<typename Position>
+	void build(uint n, const Position& position) {
+
+		// points sorted by code (by index for the same code)
+		vector<uint64_t> codes(n);
+		pointIndices.resize(n);
+		parallelRange(n, [&](int p) {
+			codes[p] = pointCode(position(p));
+			pointIndices[p] = p;
+		});
+		radixSort(codes, pointIndices, dimensions * maxDepth);
+
+		// level of the leaf of each point, from the deepest level up : a cell is split if it holds
+		// more than leafCapacity points, so if it holds 2 points leafCapacity apart in the sorted order
+		// (the deepest common cell of the points p and p + leafCapacity is given by their codes)
+		uint c = leafCapacity;
+		if (n <= c) { // only the root
+			leaves = { { 0, 0 } };
+			pointStart = { 0, n };
+			return;
+		}
+		int m = (int)(n - c);
+		vector<int> splitLevels(m);
+		parallelRange(m, [&](int p) { splitLevels[p] = std::min((int)maxDepth - 1, commonLevel(codes[p], codes[p + c])); });
+
+		// maximum over the windows [p - c, p] of split levels, in O(n) : by blocks of c + 1 levels,
+		// a window is covered by the end of a block (suffix maximum) and the start of the next (prefix maximum)
+		int w = (int)c + 1;
+		vector<int> prefixMax(m), suffixMax(m);
+		parallelRange((m + w - 1) / w, [&](int block) {
+			int start = block * w, end = std::min(start + w, m);
+			prefixMax[start] = splitLevels[start];
+			for (int q = start + 1; q < end; q++) { prefixMax[q] = std::max(prefixMax[q - 1], splitLevels[q]); }
+			suffixMax[end - 1] = splitLevels[end - 1];
+			for (int q = end - 2; q >= start; q--) { suffixMax[q] = std::max(suffixMax[q + 1], splitLevels[q]); }
+		});
+		vector<uint> pointLevels(n);
+		parallelRange(n, [&](int p) {
+			int l = std::max(0, p - (int)c), r = std::min(p, m - 1); // clipped at the ends
+			int level;
+			if (l / w != r / w) { level = std::max(suffixMax[l], prefixMax[r]); }
+			else { level = l % w == 0 ? prefixMax[r] : suffixMax[l]; } // a clipped window in one block
+			pointLevels[p] = level + 1;
+		});
+
+		// leaves with points : consecutive points in the same cell of their level,
+		// marked and counted by chunks in parallel, then gathered after a prefix sum of the counts
+		auto isFirst = [&](uint p) {
+			return p == 0 || pointLevels[p] != pointLevels[p - 1] || (codes[p] ^ codes[p - 1]) >= cellSize(pointLevels[p]);
+		};
+		int nbChunks = (n + parallelChunkSize - 1) / parallelChunkSize;
+		vector<uint> chunkStart(nbChunks + 1, 0);
+		parallelFor(cv::Range(0, nbChunks), [&](const cv::Range& range) {
+			for (int chunk = range.start; chunk < range.end; chunk++) {
+				uint count = 0;
+				for (uint p = chunk * parallelChunkSize; p < std::min((uint)(chunk + 1) * parallelChunkSize, n); p++) { count += isFirst(p); }
+				chunkStart[chunk + 1] = count;
+			}
+		});
+		for (int chunk = 0; chunk < nbChunks; chunk++) { chunkStart[chunk + 1] += chunkStart[chunk]; }
+		uint nbFull = chunkStart.back();
+		vector<uint> firstPoints(nbFull + 1);
+		parallelFor(cv::Range(0, nbChunks), [&](const cv::Range& range) {
+			for (int chunk = range.start; chunk < range.end; chunk++) {
+				uint k = chunkStart[chunk];
+				for (uint p = chunk * parallelChunkSize; p < std::min((uint)(chunk + 1) * parallelChunkSize, n); p++) {
+					if (isFirst(p)) { firstPoints[k++] = p; }
+				}
+			}
+		});
+		firstPoints[nbFull] = n;
+
+		// empty leaves : the biggest cells filling the gaps between the leaves with points in Morton order
+		// (their parents hold points, so are split), counted then written by gap, in parallel
+		auto gapStart = [&](uint k) { // end of the leaf with points k-1
+			if (k == 0) { return (uint64_t)0; }
+			uint p = firstPoints[k - 1];
+			return (codes[p] & ~(cellSize(pointLevels[p]) - 1)) + cellSize(pointLevels[p]);
+		};
+		auto gapEnd = [&](uint k) {
+			if (k == nbFull) { return cellSize(0); }
+			uint p = firstPoints[k];
+			return codes[p] & ~(cellSize(pointLevels[p]) - 1);
+		};
+		vector<uint> leafStart(nbFull + 2, 0); // first leaf of each gap, followed by its leaf with points
+		parallelRange(nbFull + 1, [&](int k) {
+			uint count = 0;
+			fillGap(gapStart(k), gapEnd(k), [&](uint64_t, uint) { count++; });
+			leafStart[k + 1] = count + (k < (int)nbFull ? 1 : 0);
+		});
+		for (uint k = 0; k <= nbFull; k++) { leafStart[k + 1] += leafStart[k]; }
+
+		leaves.resize(leafStart.back());
+		pointStart.resize(leaves.size() + 1);
+		pointStart[0] = 0;
+		parallelRange(nbFull + 1, [&](int k) {
+			uint i = leafStart[k];
+			fillGap(gapStart(k), gapEnd(k), [&](uint64_t code, uint level) {
+				leaves[i] = { code, level };
+				pointStart[++i] = firstPoints[k];
+			});
+			if (k < (int)nbFull) {
+				leaves[i] = { gapEnd(k), pointLevels[firstPoints[k]] };
+				pointStart[++i] = firstPoints[k + 1];
+			}
+		});
+	}
+
+	uint size() const { return (uint)leaves.size(); }
+
+	uint nbPoints(uint leaf) const { return pointStart[leaf + 1] - pointStart[leaf]; }
+
+	// leaf containing a point
+	uint findLeaf(const Point& p) const { return findLeaf(pointCode(p)); }
+
+	// leaf containing a cell of the deepest level
+	uint findLeaf(uint64_t code) const {
+		auto it = upper_bound(leaves.begin(), leaves.end(), code,
+			[](uint64_t c, const Leaf& leaf) { return c < leaf.code; });
+		return (uint)(it - leaves.begin()) - 1;
+	}
+
+	// position of the child of its parent
+	uint childIndex(uint leaf) const {
+		const Leaf& l = leaves[leaf];
+		return l.level == 0 ? 0 : (uint)(l.code >> (dimensions * (maxDepth - l.level))) & (nbChildren - 1);
+	}
+
+	// first corner and size of a leaf
+	Point corner(uint leaf) const {
+		Cell cell = decode(leaves[leaf].code);
+		Point p;
+		for (uint d = 0; d < dimensions; d++) { p[d] = origin[d] + cell[d] * extent[d] / (1u << maxDepth); }
+		return p;
+	}
+
+	Point cellExtent(uint level) const {
+		Point e;
+		for (uint d = 0; d < dimensions; d++) { e[d] = extent[d] / (1u << level); }
+		return e;
+	}
+
+	// size of a side of a cell : product of its extent along the other dimensions
+	float sideSize(uint level, uint dimension) const {
+		Point e = cellExtent(level);
+		float size = 1;
+		for (uint d = 0; d < dimensions; d++) {
+			if (d != dimension) { size *= e[d]; }
+		}
+		return size;
+	}
+
+	// leaves sharing a side with a leaf, in the given direction of a given dimension
+	void getNeighbors(uint leaf, uint dimension, bool direction, vector<uint>& dst) const {
+
+		uint64_t code;
+		if (!sideCell(leaf, dimension, direction, code)) { return; }
+		uint first = findLeaf(code);
+		if (leaves[first].level <= leaves[leaf].level) { // as big or bigger
+			dst.push_back(first);
+			return;
+		}
+		// split : its leaves along the shared side
+		uint32_t start = decode(leaves[leaf].code)[dimension];
+		uint32_t side = 1u << (maxDepth - leaves[leaf].level);
+		uint64_t end = code + cellSize(leaves[leaf].level);
+		for (uint i = first; i < leaves.size() && leaves[i].code < end; i++) {
+			uint32_t nc = decode(leaves[i].code)[dimension];
+			uint32_t nSide = 1u << (maxDepth - leaves[i].level);
+			if (direction ? nc == start + side : nc + nSide == start) { dst.push_back(i); }
+		}
+	}
+
+	/*
+		Neighbors of all the leaves, in CSR : the neighbors of the leaf i are
+		adjacency[adjacencyStart[i]] to adjacency[adjacencyStart[i+1]-1],
+		with the sizes of the shared sides (lengths in 2D, areas in 3D) in sideSizes.
+		A side between 2 leaves is found from the smaller one (the bigger one holds the cell of
+		the same size on that side), with one lookup per side of each leaf, run in parallel.
+		Sides between leaves of the same size are kept from the leaf with the lower coordinate only.
+	*/
+	vector<uint> adjacencyStart, adjacency;
+	vector<float> sideSizes;
+
+	void computeAdjacency() {
+
+		const uint none = UINT_MAX;
+		vector<uint> found(nbSides * size(), none); // by side : dimension, then direction
+		parallelFor(cv::Range(0, size()), [&](const cv::Range& range) {
+			for (int i = range.start; i < range.end; i++) {
+				for (uint side = 0; side < nbSides; side++) {
+					uint64_t code;
+					if (!sideCell(i, side / 2, side % 2 == 1, code)) { continue; }
+					uint j = findLeaf(code);
+					if (leaves[j].level < leaves[i].level || (leaves[j].level == leaves[i].level && side % 2 == 1)) {
+						found[nbSides * i + side] = j;
+					}
+				}
+			}
+		});
+
+		adjacencyStart.assign(size() + 1, 0);
+		for (uint i = 0; i < size(); i++) {
+			for (uint side = 0; side < nbSides; side++) {
+				uint j = found[nbSides * i + side];
+				if (j == none) { continue; }
+				adjacencyStart[i + 1]++;
+				adjacencyStart[j + 1]++;
+			}
+		}
+		for (uint i = 0; i < size(); i++) { adjacencyStart[i + 1] += adjacencyStart[i]; }
+
+		adjacency.resize(adjacencyStart.back());
+		sideSizes.resize(adjacencyStart.back());
+		vector<uint> next(adjacencyStart.begin(), adjacencyStart.end() - 1);
+		for (uint i = 0; i < size(); i++) {
+			for (uint side = 0; side < nbSides; side++) {
+				uint j = found[nbSides * i + side];
+				if (j == none) { continue; }
+				float s = sideSize(leaves[i].level, side / 2);
+				adjacency[next[i]] = j;
+				sideSizes[next[i]++] = s;
+				adjacency[next[j]] = i;
+				sideSizes[next[j]++] = s;
+			}
+		}
+	}
+
+	// number of cells of the deepest level in a cell of a given level
+	uint64_t cellSize(uint level) const { return 1ull << (dimensions * (maxDepth - level)); }
+
+	// cell of the deepest level containing a point
+	// a point on the border of 2 cells is in the lower one (the pointer tree split the cells with a strict >)
+	uint64_t pointCode(const Point& p) const {
+		double cells = (double)(1u << maxDepth);
+		Cell cell;
+		for (uint d = 0; d < dimensions; d++) {
+			double t = (p[d] - origin[d]) / (double)extent[d] * cells;
+			cell[d] = (uint32_t)std::min(std::max(ceil(t) - 1, 0.), cells - 1);
+		}
+		return encode(cell);
+	}
+
+	static uint64_t encode(const Cell& cell) {
+		uint64_t code = 0;
+		for (uint d = 0; d < dimensions; d++) { code |= Morton<dimensions>::spread(cell[d]) << d; }
+		return code;
+	}
+
+	static Cell decode(uint64_t code) {
+		Cell cell;
+		for (uint d = 0; d < dimensions; d++) { cell[d] = Morton<dimensions>::compact(code >> d); }
+		return cell;
+	}
+
+	// stable LSD radix sort of keys with their values, one byte at a time, in parallel :
+	// each chunk counts its digits, then writes them after the ones of the previous chunks
+	static void radixSort(vector<uint64_t>& keys, vector<uint>& values, uint bits) {
+
+		const int chunkSize = 1 << 16;
+		int n = (int)keys.size();
+		int nbChunks = std::max(1, (n + chunkSize - 1) / chunkSize);
+		vector<uint64_t> sortedKeys(n);
+		vector<uint> sortedValues(n);
+		vector<uint> offsets(nbChunks * 256);
+		for (uint shift = 0; shift < bits; shift += 8) {
+			fill(offsets.begin(), offsets.end(), 0);
+			parallelFor(cv::Range(0, nbChunks), [&](const cv::Range& range) {
+				for (int chunk = range.start; chunk < range.end; chunk++) {
+					uint* count = &offsets[chunk * 256];
+					for (int i = chunk * chunkSize; i < std::min((chunk + 1) * chunkSize, n); i++) { count[(keys[i] >> shift) & 255]++; }
+				}
+			});
+			uint sum = 0;
+			for (uint digit = 0; digit < 256; digit++) {
+				for (int chunk = 0; chunk < nbChunks; chunk++) {
+					uint count = offsets[chunk * 256 + digit];
+					offsets[chunk * 256 + digit] = sum;
+					sum += count;
+				}
+			}
+			parallelFor(cv::Range(0, nbChunks), [&](const cv::Range& range) {
+				for (int chunk = range.start; chunk < range.end; chunk++) {
+					uint* offset = &offsets[chunk * 256];
+					for (int i = chunk * chunkSize; i < std::min((chunk + 1) * chunkSize, n); i++) {
+						uint o = offset[(keys[i] >> shift) & 255]++;
+						sortedKeys[o] = keys[i];
+						sortedValues[o] = values[i];
+					}
+				}
+			});
+			keys.swap(sortedKeys);
+			values.swap(sortedValues);
+		}
+	}
+
+private:
+	// deepest level of a cell containing 2 cells of the deepest level
+	int commonLevel(uint64_t a, uint64_t b) const {
+		uint64_t diff = a ^ b;
+		if (diff == 0) { return maxDepth; }
+		int bit = 0; // highest different bit
+		for (int step = 32; step > 0; step /= 2) {
+			if (diff >> step) { diff >>= step; bit += step; }
+		}
+		return (int)maxDepth - 1 - bit / dimensions;
+	}
+
+	// the biggest cells covering the codes [start, end), in Morton order
+	template<typename Body>
+	void fillGap(uint64_t start, uint64_t end, const Body& body) const {
+		while (start < end) {
+			uint level = 0;
+			while (start % cellSize(level) != 0 || start + cellSize(level) > end) { level++; }
+			body(start, level);
+			start += cellSize(level);
+		}
+	}
+
+	// code of the cell of the same size as a leaf on one of its sides, false on the border of the tree
+	bool sideCell(uint leaf, uint dimension, bool direction, uint64_t& code) const {
+		Cell cell = decode(leaves[leaf].code);
+		uint32_t side = 1u << (maxDepth - leaves[leaf].level); // in cells of the deepest level
+		uint32_t& c = cell[dimension];
+		if (direction) {
+			if (c + side >= (1u << maxDepth)) { return false; }
+			c += side;
+		}
+		else {
+			if (c == 0) { return false; }
+			c -= side;
+		}
+		code = encode(cell);
+		return true;
+	}
+};
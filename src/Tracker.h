@@ -0,0 +1,159 @@
+#pragma once
+
+#include <opencv2\opencv.hpp>
+#include <vector>
+
+#include "SIFT.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+	Tracking of SIFT keypoints along a video stream :
+	the points of the previous frame are carried to the new one by a pyramidal
+	optical flow, and the detection only runs in the cells of a grid
+	where too many tracks were lost.
+	The id of the track of a point is stored in its KeyPoint::class_id,
+	so points with the same id in 2 frames are already matched.
+*/
+struct FeatureTracker {
+
+	SIFT& sift;
+
+	uint gridCols = 8, gridRows = 6; // cells where the points are counted
+	uint minPointsPerCell = 2; // below that, the cell is detected again
+	Size windowSize = Size(21, 21); // optical flow window
+	int pyramidLevels = 3; // optical flow pyramid
+	float maxError = 20; // tracks with a bigger optical flow error are lost
+	float minDistance = 3; // new points closer to a track are the same feature, and are not added
+
+	vector<KeyPoint> keypoints; // points of the last frame
+
+private:
+	vector<Mat> prevPyramid; // optical flow pyramid of the last frame
+	int nextId = 0;
+	SIFT::Workspace workspace, cellWorkspace; // buffers of the full frame and of the cells
+
+public:
+	FeatureTracker(SIFT& sift) : sift(sift) {}
+
+	void reset() {
+		keypoints.clear();
+		prevPyramid.clear();
+	}
+
+	// processes the next frame of the stream
+	// keypoints and descriptors are updated for this frame
+	// (the descriptors are overwritten by the next frame)
+	void track(const Mat& frame, Mat& descriptors) {
+
+		Mat& grayF = workspace.grayF;
+		SIFT::toGrayFloat(frame, grayF);
+		Mat gray; grayF.convertTo(gray, CV_8U); // the optical flow works on bytes
+
+		// this pyramid is also the previous one of the next frame
+		vector<Mat> pyramid;
+		buildOpticalFlowPyramid(gray, pyramid, windowSize, pyramidLevels);
+
+		if (prevPyramid.empty()) { // first frame : full detection
+			sift.detectGray(workspace, grayF, keypoints);
+			for (auto& point : keypoints) { point.class_id = nextId++; }
+		}
+		else {
+			trackPoints(pyramid, gray.size());
+			detectLostCells(grayF);
+		}
+
+		sift.computeGray(workspace, grayF, keypoints, descriptors);
+		prevPyramid.swap(pyramid);
+	}
+
+private:
+	void trackPoints(const vector<Mat>& pyramid, Size size) {
+
+		if (keypoints.empty()) { return; }
+
+		vector<Point2f> prevPts, nextPts;
+		KeyPoint::convert(keypoints, prevPts);
+		vector<uchar> status;
+		vector<float> err;
+		calcOpticalFlowPyrLK(prevPyramid, pyramid, prevPts, nextPts, status, err,
+			windowSize, pyramidLevels);
+
+		// the descriptors need the same border as the detection
+		float border = (float)sift.borderSize + 1;
+		uint kept = 0;
+		for (uint i = 0; i < keypoints.size(); i++) {
+			const Point2f& pt = nextPts[i];
+			if (status[i] && err[i] < maxError &&
+				pt.x >= border && pt.x < size.width - border &&
+				pt.y >= border && pt.y < size.height - border) {
+				keypoints[kept] = keypoints[i];
+				keypoints[kept].pt = pt;
+				kept++;
+			}
+		}
+		keypoints.resize(kept);
+	}
+
+	// runs the detection again in the cells with too few tracked points
+	void detectLostCells(const Mat& grayF) {
+
+		int w = grayF.size().width;
+		int h = grayF.size().height;
+		int cellW = (w + gridCols - 1) / gridCols;
+		int cellH = (h + gridRows - 1) / gridRows;
+		uint pointsPerCell = max(1u, sift.maxPoints / (gridCols * gridRows));
+
+		// tracked points per cell
+		vector<vector<Point2f>> tracks(gridCols * gridRows);
+		for (const auto& point : keypoints) {
+			uint cx = min(gridCols - 1, (uint)point.pt.x / cellW);
+			uint cy = min(gridRows - 1, (uint)point.pt.y / cellH);
+			tracks[cy * gridCols + cx].push_back(point.pt);
+		}
+		// a new point close to a track of its cell or of a neighbor cell
+		auto isTracked = [&](const Point2f& pt, uint cx, uint cy) {
+			for (uint ny = cy > 0 ? cy - 1 : 0; ny <= min(gridRows - 1, cy + 1); ny++) {
+				for (uint nx = cx > 0 ? cx - 1 : 0; nx <= min(gridCols - 1, cx + 1); nx++) {
+					for (const auto& track : tracks[ny * gridCols + nx]) {
+						Point2f d = track - pt;
+						if (d.dot(d) < minDistance * minDistance) { return true; }
+					}
+				}
+			}
+			return false;
+		};
+
+		// the detection sees the pixels around the cell,
+		// so that points close to its edges are still inside the SIFT border
+		// the region has the same size for every cell (moved inside the image at its borders),
+		// so that the workspace of the cells is never reallocated
+		int margin = sift.borderSize + 1;
+		Size roiSize(min(cellW + 2 * margin, w), min(cellH + 2 * margin, h));
+		for (uint cy = 0; cy < gridRows; cy++) {
+			for (uint cx = 0; cx < gridCols; cx++) {
+				uint count = (uint)tracks[cy * gridCols + cx].size();
+				if (count >= minPointsPerCell) { continue; }
+
+				Rect cell(cx * cellW, cy * cellH, cellW, cellH);
+				Rect roi(min(max(cell.x - margin, 0), w - roiSize.width),
+					min(max(cell.y - margin, 0), h - roiSize.height), roiSize.width, roiSize.height);
+
+				vector<KeyPoint> cellPoints;
+				sift.detectGray(cellWorkspace, grayF(roi), cellPoints);
+
+				// strongest points first
+				for (auto& point : cellPoints) {
+					if (count >= pointsPerCell) { break; }
+					point.pt.x += roi.x;
+					point.pt.y += roi.y;
+					if (!cell.contains(point.pt) || isTracked(point.pt, cx, cy)) { continue; }
+					point.class_id = nextId++;
+					keypoints.push_back(point);
+					count++;
+				}
+			}
+		}
+	}
+};
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <opencv2\opencv.hpp>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include "Parallel.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+	Image retrieval with a vocabulary tree (Nister & Stewenius) :
+	descriptors are quantized into visual words by a hierarchical k-means,
+	frames are stored as tf-idf weighted bags of words in inverted files,
+	and the frames most similar to a new one are found by only looking at
+	the frames sharing words with it
+	Used to choose the frame pairs to match, and to propose loop closures
+*/
+struct VocabularyTree {
+
+	uint branching = 10, depth = 4; // up to branching ^ depth words
+
+private:
+	Mat centers; // one row (CV_32F) per node, the root's is unused
+	vector<int> firstChild; // children of a node are contiguous, -1 for leaves
+	vector<int> nbChildren;
+	vector<int> word; // word of a leaf, -1 for internal nodes
+	vector<float> idf; // per word
+
+	struct Entry {
+		uint frame;
+		float weight; // of the word in the frame
+	};
+	vector<vector<Entry>> invertedFiles; // per word, by increasing frame
+	uint nbFrames = 0;
+
+public:
+	uint nbWords() const { return (uint)idf.size(); }
+
+	uint size() const { return nbFrames; }
+
+	// learns the words from a sample of frames (the descriptors of one frame per Mat)
+	// the frames of the sample are not added to the database
+	void train(const vector<Mat>& sampleFrames) {
+
+		Mat samples;
+		for (const auto& frame : sampleFrames) { samples.push_back(frame); }
+		Mat samplesF;
+		samples.convertTo(samplesF, CV_32F);
+
+		centers = Mat::zeros(1, samplesF.cols, CV_32F);
+		firstChild = { -1 };
+		nbChildren = { 0 };
+		word = { -1 };
+		idf.clear();
+
+		vector<int> indices(samplesF.rows);
+		for (int i = 0; i < samplesF.rows; i++) { indices[i] = i; }
+		split(0, samplesF, indices, 0);
+
+		// inverse document frequency : rare words are more discriminative
+		vector<uint> framesWithWord(nbWords(), 0);
+		for (const auto& frame : sampleFrames) {
+			vector<pair<uint, float>> bow;
+			bagOfWords(frame, bow, false);
+			for (const auto& w : bow) { framesWithWord[w.first]++; }
+		}
+		for (uint w = 0; w < nbWords(); w++) {
+			idf[w] = log((float)sampleFrames.size() / max(1u, framesWithWord[w]));
+		}
+
+		invertedFiles.assign(nbWords(), vector<Entry>());
+		nbFrames = 0;
+	}
+
+	bool trained() const { return !firstChild.empty(); }
+
+	// word of a descriptor, by going down the tree to the closest center
+	uint quantize(const uchar* desc) const {
+
+		checkTrained();
+		int node = 0;
+		while (firstChild[node] >= 0) {
+			int best = firstChild[node];
+			float bestDist = FLT_MAX;
+			for (int c = firstChild[node]; c < firstChild[node] + nbChildren[node]; c++) {
+				const float* center = centers.ptr<float>(c);
+				float dist = 0;
+				for (int j = 0; j < centers.cols; j++) {
+					float d = center[j] - desc[j];
+					dist += d*d;
+				}
+				if (dist < bestDist) {
+					bestDist = dist;
+					best = c;
+				}
+			}
+			node = best;
+		}
+		return word[node];
+	}
+
+	// adds the descriptors of a new frame to the database, returns its frame index
+	uint add(const Mat& descriptors) {
+
+		checkTrained();
+		uint frame = nbFrames++;
+		vector<pair<uint, float>> bow;
+		bagOfWords(descriptors, bow);
+		for (const auto& w : bow) { invertedFiles[w.first].push_back({ frame, w.second }); }
+		return frame;
+	}
+
+	// the n frames of the database most similar to the descriptors, most similar first,
+	// with their score in [0, 1] (1 for the same bag of words)
+	// the last excludeLast frames are ignored (the neighbors of the current frame, for loop closures)
+	void query(const Mat& descriptors, uint n, vector<pair<uint, float>>& results,
+		uint excludeLast = 0) const {
+
+		checkTrained();
+		results.clear();
+		uint maxFrame = nbFrames - min(excludeLast, nbFrames);
+		if (maxFrame == 0) { return; }
+
+		vector<pair<uint, float>> bow;
+		bagOfWords(descriptors, bow);
+
+		// L1 distance between normalized vectors, from the common words only :
+		// |q - d| = 2 - 2 * sum(min(q_w, d_w))
+		// in parallel over ranges of frames (the inverted files are sorted by frame),
+		// the scores of the frames sharing words with the query only
+		int nbRanges = max(1, getNumThreads());
+		uint rangeSize = (maxFrame + nbRanges - 1) / nbRanges;
+		vector<unordered_map<uint, float>> scores(nbRanges);
+		parallelFor(Range(0, nbRanges), [&](const Range& range) {
+			for (int r = range.start; r < range.end; r++) {
+				uint f0 = r * rangeSize, f1 = min(maxFrame, f0 + rangeSize);
+				for (const auto& w : bow) {
+					const auto& entries = invertedFiles[w.first];
+					auto it = lower_bound(entries.begin(), entries.end(), f0,
+						[](const Entry& e, uint frame) { return e.frame < frame; });
+					for (; it != entries.end() && it->frame < f1; it++) {
+						scores[r][it->frame] += min(w.second, it->weight);
+					}
+				}
+			}
+		});
+
+		for (const auto& rangeScores : scores) {
+			for (const auto& score : rangeScores) {
+				if (score.second > 0) { results.push_back(score); }
+			}
+		}
+		auto end = results.begin() + min((size_t)n, results.size());
+		partial_sort(results.begin(), end, results.end(),
+			[](const pair<uint, float>& a, const pair<uint, float>& b) {
+			return a.second != b.second ? a.second > b.second : a.first < b.first;
+		});
+		results.erase(end, results.end());
+	}
+
+private:
+	void checkTrained() const {
+		if (!trained()) { cerr << "Error, the vocabulary tree is not trained" << endl; throw 1; }
+	}
+
+	void split(int node, const Mat& samples, const vector<int>& indices, uint level) {
+
+		if (level == depth || indices.size() <= branching) {
+			word[node] = nbWords();
+			idf.push_back(0);
+			return;
+		}
+
+		Mat data((int)indices.size(), samples.cols, CV_32F);
+		for (uint i = 0; i < indices.size(); i++) { samples.row(indices[i]).copyTo(data.row(i)); }
+		Mat labels, clusterCenters;
+		kmeans(data, branching, labels, TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 10, 1e-3),
+			1, KMEANS_PP_CENTERS, clusterCenters);
+
+		int first = centers.rows;
+		firstChild[node] = first;
+		nbChildren[node] = branching;
+		vector<vector<int>> childIndices(branching);
+		for (uint c = 0; c < branching; c++) {
+			centers.push_back(clusterCenters.row(c));
+			firstChild.push_back(-1);
+			nbChildren.push_back(0);
+			word.push_back(-1);
+		}
+		for (uint i = 0; i < indices.size(); i++) {
+			childIndices[labels.at<int>(i)].push_back(indices[i]);
+		}
+		for (uint c = 0; c < branching; c++) {
+			split(first + c, samples, childIndices[c], level + 1);
+		}
+	}
+
+	// sorted words of the descriptors with their weight, normalized to a sum of 1
+	void bagOfWords(const Mat& descriptors, vector<pair<uint, float>>& bow, bool weighted = true) const {
+
+		vector<uint> words(descriptors.rows);
+		parallelFor(Range(0, descriptors.rows), [&](const Range& range) {
+			for (int i = range.start; i < range.end; i++) { words[i] = quantize(descriptors.ptr<uchar>(i)); }
+		});
+		sort(words.begin(), words.end());
+
+		bow.clear();
+		float sum = 0;
+		for (uint i = 0; i < words.size(); i++) {
+			if (i > 0 && words[i] == words[i - 1]) { bow.back().second += weighted ? idf[words[i]] : 1; }
+			else { bow.push_back({ words[i], weighted ? idf[words[i]] : 1 }); }
+			sum += weighted ? idf[words[i]] : 1;
+		}
+		for (auto& w : bow) { w.second = sum > 0 ? w.second / sum : 0; }
+	}
+};
@@ -5,6 +5,8 @@
 #include <vector>
 
 #include "SIFT.h"
+#include "Matcher.h"
+#include "Pipeline.h"
 
 using namespace std;
 using namespace cv;
@@ -34,35 +36,33 @@ int SIFTMatchTest(int argc, char* argv[]) {
 	sift.detectAndCompute(im1, noArray(), points1, desc1);
 
 	vector<DMatch> matches;
-	for (uint i0 = 0; i0 < points0.size(); i0++) {
-		KeyPoint& p0 = points0[i0];
-		float bestDist = INFINITY;
-		uint bestMatch = 0;
-		uchar* values0 = desc0.data + i0 * 128;
-
-		for (uint i1 = 0; i1 < points1.size(); i1++) {
-			uint dist = 0;
-			uchar* values1 = desc1.data + i1 * 128;
-			for (uint j = 0; j < 128; j++) {
-				int d = ((int)values0[j]) - values1[j];
-				dist += d*d;
-			}
-			/* spatial distance match (totally cheating)
-			dist = (points0[i0].pt.x - points1[i1].pt.x)*
-			(points0[i0].pt.x - points1[i1].pt.x) +
-			(points0[i0].pt.y - points1[i1].pt.y)*
-			(points0[i0].pt.y - points1[i1].pt.y);*/
-			if (dist < bestDist) {
-				bestDist = (float) dist;
-				bestMatch = i1;
-			}
-		}
-		matches.push_back(DMatch(i0, bestMatch, bestDist));
-	}
+	BruteForceMatcher matcher;
+	matcher.match(desc0, desc1, matches);
 
 	Mat dst;
 	cv::drawMatches(im0, points0, im1, points1, matches, dst);
 	cv::imshow("Matching", dst); cv::waitKey();
 
 	return 0;
-}
\ No newline at end of file
+}
+
+int VideoPipelineTest(int argc, char* argv[]) {
+
+	if (argc < 2) {
+		cerr << "Command line arguments are : " << endl;
+		cerr << "<video>" << endl;
+		return 1;
+	}
+
+	VideoPipeline pipeline;
+	uint nbMatches = 0;
+	pipeline.onFrame = [&](const VideoPipeline::FrameMatches& frame) {
+		for (const auto& m : frame.matches) { nbMatches += (uint)m.second.size(); }
+	};
+	uint nbFrames = pipeline.run(argv[1]);
+
+	cout << nbFrames << " frames, " << nbMatches << " matches" << endl;
+	pipeline.printStats(cout);
+
+	return 0;
+}
@@ -0,0 +1,238 @@
+#include "tests.h"
+
+#include <iostream>
+#include <opencv2\opencv.hpp>
+#include <vector>
+
+#include "SIFT.h"
+#include "Matcher.h"
+#include "HNSW.h"
+#include "CompactDescriptors.h"
+#include "VocabularyTree.h"
+
+using namespace std;
+using namespace cv;
+
+// recall and latency of the HNSW index against the exact matcher :
+// the descriptors of every image but the last one are indexed,
+// the ones of the last image are queried
+int ANNBenchmark(int argc, char* argv[]) {
+
+	if (argc < 3) {
+		cerr << "Command line arguments are : " << endl;
+		cerr << "<image1> ... <imageN> <queryImage>" << endl;
+		return 1;
+	}
+
+	SIFT sift;
+	HNSWIndex index;
+	Mat allDesc; // for the exact matcher
+
+	int64 start = getTickCount();
+	for (int i = 1; i < argc - 1; i++) {
+		Mat im = imread(argv[i]);
+		if (im.empty()) { cerr << "no image " << argv[i] << endl; throw 1; }
+		vector<KeyPoint> points;
+		Mat desc;
+		sift.detectAndCompute(im, noArray(), points, desc);
+		index.add(desc, i - 1);
+		allDesc.push_back(desc);
+	}
+	cout << index.size() << " descriptors indexed in " <<
+		(getTickCount() - start) / getTickFrequency() << " s (with extraction)" << endl;
+
+	Mat query = imread(argv[argc - 1]);
+	if (query.empty()) { cerr << "no image " << argv[argc - 1] << endl; throw 1; }
+	vector<KeyPoint> queryPoints;
+	Mat queryDesc;
+	sift.detectAndCompute(query, noArray(), queryPoints, queryDesc);
+
+	BruteForceMatcher exact;
+	exact.ratio = 1;
+	vector<DMatch> truth;
+	start = getTickCount();
+	exact.match(queryDesc, allDesc, truth);
+	double exactTime = (getTickCount() - start) / getTickFrequency();
+	cout << "exact : " << 1000 * exactTime << " ms for " << queryDesc.rows << " queries" << endl;
+
+	for (uint ef : { 8, 16, 32, 64, 128, 256 }) {
+		index.efSearch = ef;
+		vector<vector<DMatch>> matches;
+		start = getTickCount();
+		index.knnSearch(queryDesc, 1, matches);
+		double time = (getTickCount() - start) / getTickFrequency();
+
+		// same distance as the exact nearest neighbor (there can be ties)
+		uint found = 0;
+		for (uint q = 0; q < truth.size(); q++) {
+			if (!matches[q].empty() && matches[q][0].distance == truth[q].distance) { found++; }
+		}
+		cout << "efSearch " << ef << " : recall " << (float)found / max((size_t)1, truth.size()) <<
+			", " << 1000 * time << " ms" << endl;
+	}
+
+	return 0;
+}
+
+// accuracy and speed of the compact descriptors against the full ones :
+// trained on the descriptors of every image but the last 2, which are matched
+int CompactDescriptorsBenchmark(int argc, char* argv[]) {
+
+	if (argc < 4) {
+		cerr << "Command line arguments are : " << endl;
+		cerr << "<trainImage1> ... <trainImageN> <image1> <image2>" << endl;
+		return 1;
+	}
+
+	SIFT sift;
+	Mat samples;
+	for (int i = 1; i < argc - 2; i++) {
+		Mat im = imread(argv[i]);
+		if (im.empty()) { cerr << "no image " << argv[i] << endl; throw 1; }
+		vector<KeyPoint> points;
+		Mat desc;
+		sift.detectAndCompute(im, noArray(), points, desc);
+		samples.push_back(desc);
+	}
+
+	Mat desc[2];
+	for (int i = 0; i < 2; i++) {
+		Mat im = imread(argv[argc - 2 + i]);
+		if (im.empty()) { cerr << "no image " << argv[argc - 2 + i] << endl; throw 1; }
+		vector<KeyPoint> points;
+		sift.detectAndCompute(im, noArray(), points, desc[i]);
+	}
+
+	// the matches of the full descriptors are the reference
+	BruteForceMatcher matcher;
+	auto run = [&](const string& name, const Mat& desc0, const Mat& desc1,
+		const vector<DMatch>* reference) {
+
+		vector<DMatch> matches;
+		int64 start = getTickCount();
+		matcher.match(desc0, desc1, matches);
+		double time = (getTickCount() - start) / getTickFrequency();
+
+		cout << name << " : " << desc0.cols << " bytes, " << matches.size() << " matches, " <<
+			1000 * time << " ms";
+		if (reference != NULL) {
+			vector<int> refTrain(desc0.rows, -1);
+			for (const auto& m : *reference) { refTrain[m.queryIdx] = m.trainIdx; }
+			uint same = 0;
+			for (const auto& m : matches) { if (refTrain[m.queryIdx] == m.trainIdx) { same++; } }
+			cout << ", " << (float)same / max((size_t)1, reference->size()) << " of the reference matches";
+		}
+		cout << endl;
+		return matches;
+	};
+
+	matcher.normType = NORM_L2SQR;
+	vector<DMatch> reference = run("full", desc[0], desc[1], NULL);
+
+	for (int dims : { 32, 64 }) {
+		DescriptorPCA pca;
+		pca.train(samples, dims);
+		Mat compact0, compact1;
+		pca.project(desc[0], compact0);
+		pca.project(desc[1], compact1);
+		run("PCA " + to_string(dims), compact0, compact1, &reference);
+	}
+
+	DescriptorBinarizer binarizer;
+	binarizer.train(samples);
+	Mat codes0, codes1;
+	binarizer.binarize(desc[0], codes0);
+	binarizer.binarize(desc[1], codes1);
+	matcher.normType = NORM_HAMMING;
+	run("binary", codes0, codes1, &reference);
+
+	return 0;
+}
+
+// throughput of the exact matcher on 10000 x 10000 random SIFT sized descriptors,
+// against one distance per pair (without the blocking)
+int MatcherBenchmark(int argc, char* argv[]) {
+
+	int n = 10000;
+	RNG rng(1);
+	Mat query(n, 128, CV_8U), train(n, 128, CV_8U);
+	rng.fill(query, RNG::UNIFORM, 0, 64);
+	rng.fill(train, RNG::UNIFORM, 0, 64);
+
+	BruteForceMatcher matcher;
+	matcher.ratio = 1;
+	vector<DMatch> matches;
+	matcher.match(query, train, matches); // warming up
+	int64 start = getTickCount();
+	matcher.match(query, train, matches);
+	double time = (getTickCount() - start) / getTickFrequency();
+
+	// one distance per pair, on a sample of the queries
+	int nbSamples = 100;
+	vector<DMatch> naive(nbSamples);
+	start = getTickCount();
+	parallel_for_(Range(0, nbSamples), [&](const Range& range) {
+		for (int q = range.start; q < range.end; q++) {
+			uint best = UINT_MAX;
+			int bestIndex = -1;
+			for (int t = 0; t < n; t++) {
+				uint dist = BruteForceMatcher::distance(query.ptr<uchar>(q), train.ptr<uchar>(t));
+				if (dist < best) {
+					best = dist;
+					bestIndex = t;
+				}
+			}
+			naive[q] = DMatch(q, bestIndex, (float)best);
+		}
+	});
+	double naiveTime = (getTickCount() - start) / getTickFrequency() * n / nbSamples;
+
+	uint same = 0;
+	for (int q = 0; q < nbSamples; q++) {
+		if (matches[q].distance == naive[q].distance) { same++; }
+	}
+
+	double pairs = (double)n * n;
+	cout << n << "x" << n << " : " << 1000 * time << " ms, " << pairs / time * 1e-9 << " G distances/s (pair by pair " <<
+		pairs / naiveTime * 1e-9 << " G distances/s), " << same << " of " << nbSamples << " samples checked" << endl;
+
+	return same == (uint)nbSamples ? 0 : 1;
+}
+
+// every frame of the database retrieves itself first, with a vocabulary learnt on the same frames
+// (random descriptors, the test needs no images)
+int VocabularyTreeTest(int argc, char* argv[]) {
+
+	uint nbFrames = 50;
+	RNG rng(1);
+	vector<Mat> frames(nbFrames);
+	for (auto& frame : frames) {
+		frame.create(200, 128, CV_8U);
+		rng.fill(frame, RNG::UNIFORM, 0, 256);
+	}
+
+	VocabularyTree tree;
+	tree.branching = 8;
+	tree.depth = 3;
+	try {
+		vector<pair<uint, float>> results;
+		tree.query(frames[0], 1, results);
+		cerr << "query before train" << endl;
+		return 1;
+	}
+	catch (int) {}
+
+	tree.train(frames);
+	for (const auto& frame : frames) { tree.add(frame); }
+
+	uint retrieved = 0;
+	for (uint f = 0; f < nbFrames; f++) {
+		vector<pair<uint, float>> results;
+		tree.query(frames[f], 3, results);
+		if (!results.empty() && results[0].first == f) { retrieved++; }
+	}
+	cout << tree.nbWords() << " words, " << retrieved << " of " << nbFrames <<
+		" frames retrieved first by themselves" << endl;
+
+	return retrieved == nbFrames ? 0 : 1;
+}
@@ -1,9 +1,11 @@
 #include "tests.h"
 
 #include "Poisson.h"
+#include "PoissonTiled.h"
 
 #include <opencv2\opencv.hpp>
 #include <vector>
+#include <functional>
 
 void testPoisson2D(std::string srcImage) {
 
@@ -45,7 +47,103 @@ void testPoisson2D(std::string srcImage) {
 
 	cv::waitKey(1);
 
-	cv::imshow("integration", 0.5 + grad.poissonIntegration());
+	PoissonSolver solver;
+	int64 start = cv::getTickCount();
+	cv::Mat integration = grad.poissonIntegration(solver);
+	double time = (cv::getTickCount() - start) / cv::getTickFrequency();
+	std::cout << "multigrid : " << solver.iterations << " cycles, residual " << solver.residual <<
+		", " << 1000 * time << " ms" << std::endl;
+	cv::imshow("integration", 0.5 + integration);
+
+	// only over the pixels reached by the splats
+	cv::Mat covered = (grad.x != 0) | (grad.y != 0);
+	MaskedPoissonSolver maskedSolver;
+	start = cv::getTickCount();
+	cv::Mat maskedIntegration = grad.poissonIntegration(maskedSolver, covered);
+	time = (cv::getTickCount() - start) / cv::getTickFrequency();
+	std::cout << "masked : " << maskedSolver.size() << " unknowns, " << maskedSolver.iterations <<
+		" iterations, residual " << maskedSolver.residual << ", " << 1000 * time << " ms" << std::endl;
+	cv::imshow("masked integration", 0.5 + maskedIntegration);
 
 	cv::waitKey();
-}
\ No newline at end of file
+}
+
+// multigrid against the direct spectral solve of the integration of the gradient of an image,
+// resized from 1 to 16 megapixels
+int PoissonBenchmark(int argc, char* argv[]) {
+
+	if (argc < 2) {
+		std::cerr << "Command line arguments are : " << std::endl;
+		std::cerr << "<image>" << std::endl;
+		return 1;
+	}
+
+	cv::Mat src = cv::imread(argv[1], cv::IMREAD_GRAYSCALE);
+	if (src.empty()) { std::cerr << "no image " << argv[1] << std::endl; throw 1; }
+
+	PoissonSolver multigrid;
+	SpectralPoissonSolver spectral;
+	for (int megapixels : { 1, 2, 4, 8, 16 }) {
+
+		double factor = sqrt(megapixels * 1e6 / src.total());
+		cv::Mat im;
+		cv::resize(src, im, cv::Size(), factor, factor, cv::INTER_LINEAR);
+		cv::Mat gradX, gradY;
+		cv::Sobel(im, gradX, CV_32F, 1, 0, 3, 1.0 / 255);
+		cv::Sobel(im, gradY, CV_32F, 0, 1, 3, 1.0 / 255);
+		Gradient grad(gradX, gradY);
+
+		auto time = [](const std::function<cv::Mat()>& solve, cv::Mat& result) {
+			solve(); // warming up the buffers of the solver
+			int64 start = cv::getTickCount();
+			result = solve();
+			return 1000 * (cv::getTickCount() - start) / cv::getTickFrequency();
+		};
+		cv::Mat mgResult, spectralResult;
+		double mgTime = time([&]() { return grad.poissonIntegration(multigrid); }, mgResult);
+		double spectralTime = time([&]() { return grad.poissonIntegration(spectral); }, spectralResult);
+
+		std::cout << im.cols << "x" << im.rows << " : multigrid " << mgTime << " ms (" <<
+			multigrid.iterations << " cycles, residual " << multigrid.residual << "), spectral " <<
+			spectralTime << " ms, max difference " << cv::norm(mgResult, spectralResult, cv::NORM_INF) << std::endl;
+	}
+
+	return 0;
+}
+
+// out-of-core integration by tiles against the integration of the whole image in memory
+int TiledPoissonTest(int argc, char* argv[]) {
+
+	if (argc < 2) {
+		std::cerr << "Command line arguments are : " << std::endl;
+		std::cerr << "<image> [tileSize]" << std::endl;
+		return 1;
+	}
+
+	cv::Mat src = cv::imread(argv[1], cv::IMREAD_GRAYSCALE);
+	if (src.empty()) { std::cerr << "no image " << argv[1] << std::endl; throw 1; }
+
+	cv::Mat gradX, gradY;
+	cv::Sobel(src, gradX, CV_32F, 1, 0, 3, 1.0 / 255);
+	cv::Sobel(src, gradY, CV_32F, 0, 1, 3, 1.0 / 255);
+	cv::Mat reference = Gradient(gradX, gradY).poissonIntegration();
+
+	RawImage::save("gradX.raw", gradX);
+	RawImage::save("gradY.raw", gradY);
+	RawImage rawX("gradX.raw"), rawY("gradY.raw");
+	RawImage rawDst("integration.raw", src.cols, src.rows);
+
+	TiledPoissonIntegration tiled;
+	if (argc > 2) { tiled.tileSize = atoi(argv[2]); }
+	int64 start = cv::getTickCount();
+	tiled.integrate(rawX, rawY, rawDst);
+	double time = (cv::getTickCount() - start) / cv::getTickFrequency();
+
+	cv::Mat result;
+	rawDst.read(rawDst.rect(), result);
+	std::cout << "tiled : " << tiled.iterations << " iterations, residual " << tiled.residual <<
+		", coarse factor " << tiled.factor << ", " << 1000 * time << " ms, max difference " <<
+		cv::norm(result, reference, cv::NORM_INF) << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+#include "tests.h"
+
+#include <iostream>
+#include <opencv2\opencv.hpp>
+#include <vector>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+
+#include "SIFT.h"
+
+using namespace std;
+using namespace cv;
+
+// the replaced operator new only sees the allocations of this module (the containers of the headers) :
+// those made inside the OpenCV libraries, the Mat buffers among them, are not seen when OpenCV is a DLL,
+// so the Mat buffers are counted by the default allocator of Mat
+static atomic<bool> countingAllocations(false);
+static atomic<size_t> nbAllocations(0), nbMatAllocations(0);
+
+void* operator new(size_t size) {
+	if (countingAllocations) { nbAllocations++; }
+	void* p = malloc(size > 0 ? size : 1);
+	if (p == NULL) { throw bad_alloc(); }
+	return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+
+// standard allocator of OpenCV, counting the buffers it allocates
+struct CountingMatAllocator : MatAllocator {
+
+	MatAllocator* base = Mat::getStdAllocator();
+
+	UMatData* allocate(int dims, const int* sizes, int type,
+		void* data, size_t* step, int flags, UMatUsageFlags usageFlags) const {
+		if (countingAllocations && data == NULL) { nbMatAllocations++; }
+		return base->allocate(dims, sizes, type, data, step, flags, usageFlags);
+	}
+
+	bool allocate(UMatData* data, int accessFlags, UMatUsageFlags usageFlags) const {
+		return base->allocate(data, accessFlags, usageFlags);
+	}
+
+	void deallocate(UMatData* data) const { base->deallocate(data); }
+};
+
+// allocations of the extraction of frames of the same size once the workspace is warm
+// the thread pool of parallel_for_ allocates its own jobs,
+// so the extraction itself is checked on a single thread
+int SIFTAllocationTest(int argc, char* argv[]) {
+
+	if (argc < 2) {
+		cerr << "Command line arguments are : " << endl;
+		cerr << "<image>" << endl;
+		return 1;
+	}
+
+	Mat image = imread(argv[1]);
+	if (image.empty()) { cerr << "no image " << argv[1] << endl; throw 1; }
+
+	SIFT sift;
+	SIFT::Workspace workspace;
+	vector<KeyPoint> keypoints;
+	keypoints.reserve(sift.maxPoints);
+	Mat descriptors;
+
+	// a reallocated buffer of the workspace also shows that it was not reused
+	auto buffers = [&]() {
+		vector<const uchar*> data = { workspace.grayF.data, workspace.grayU.data, workspace.maskSums.data,
+			workspace.norms.data, workspace.bins.data, workspace.descriptors.data };
+		for (const auto& octave : workspace.pyramid) {
+			for (const Mat& level : octave) { data.push_back(level.data); }
+		}
+		for (const Mat& rows : workspace.blurRows) { data.push_back(rows.data); }
+		return data;
+	};
+
+	CountingMatAllocator allocator;
+	MatAllocator* defaultAllocator = Mat::getDefaultAllocator();
+	Mat::setDefaultAllocator(&allocator);
+
+	bool sameBuffers = true;
+	auto countAllocations = [&](uint nbFrames) {
+		// warming up : the first frames size the buffers
+		for (uint i = 0; i < 2; i++) {
+			sift.detectAndCompute(workspace, image, noArray(), keypoints, descriptors);
+		}
+		vector<const uchar*> before = buffers();
+		nbAllocations = 0;
+		nbMatAllocations = 0;
+		countingAllocations = true;
+		for (uint i = 0; i < nbFrames; i++) {
+			sift.detectAndCompute(workspace, image, noArray(), keypoints, descriptors);
+		}
+		countingAllocations = false;
+		sameBuffers = sameBuffers && buffers() == before;
+		return nbAllocations.load() + nbMatAllocations.load();
+	};
+
+	int nbThreads = getNumThreads();
+	setNumThreads(0);
+	size_t serial = countAllocations(3);
+	setNumThreads(nbThreads);
+	size_t parallel = countAllocations(3);
+
+	Mat::setDefaultAllocator(defaultAllocator);
+
+	cout << keypoints.size() << " points" << endl;
+	cout << "allocations over 3 frames : " << serial << " (1 thread), " <<
+		parallel << " (" << nbThreads << " threads)" << endl;
+	cout << "workspace buffers " << (sameBuffers ? "reused" : "reallocated") << endl;
+
+	return serial == 0 && sameBuffers ? 0 : 1;
+}
+
+// points of the fixed point pyramid against the float one, on the same images :
+// a fixed point keypoint is repeated if a float keypoint of the same scale
+// is less than one pixel of its octave away
+int FixedPointAccuracyTest(int argc, char* argv[]) {
+
+	if (argc < 2) {
+		cerr << "Command line arguments are : " << endl;
+		cerr << "<image1> ... <imageN>" << endl;
+		return 1;
+	}
+
+	SIFT floatSift, fixedSift;
+	fixedSift.fixedPoint = true;
+	SIFT::Workspace floatWorkspace, fixedWorkspace;
+
+	uint nbRepeated = 0, nbPoints = 0;
+	for (int i = 1; i < argc; i++) {
+		Mat image = imread(argv[i]);
+		if (image.empty()) { cerr << "no image " << argv[i] << endl; throw 1; }
+
+		vector<KeyPoint> floatPoints, fixedPoints;
+		auto detect = [&](SIFT& sift, SIFT::Workspace& workspace, vector<KeyPoint>& points) {
+			sift.detect(workspace, image, points); // warming up the workspace
+			int64 start = getTickCount();
+			sift.detect(workspace, image, points);
+			return 1000 * (getTickCount() - start) / getTickFrequency();
+		};
+		double floatTime = detect(floatSift, floatWorkspace, floatPoints);
+		double fixedTime = detect(fixedSift, fixedWorkspace, fixedPoints);
+
+		uint repeated = 0;
+		for (const auto& p : fixedPoints) {
+			float octaveSize = (float)(1 << (p.octave & 255));
+			for (const auto& q : floatPoints) {
+				if (q.octave == p.octave && norm(q.pt - p.pt) <= octaveSize) { repeated++; break; }
+			}
+		}
+		nbRepeated += repeated;
+		nbPoints += (uint)fixedPoints.size();
+
+		cout << argv[i] << " (" << image.cols << "x" << image.rows << ") : " <<
+			"float " << floatPoints.size() << " points " << floatTime << " ms, " <<
+			"fixed " << fixedPoints.size() << " points " << fixedTime << " ms, " <<
+			"repeatability " << (float)repeated / max((size_t)1, fixedPoints.size()) << endl;
+	}
+
+	cout << "repeatability : " << (float)nbRepeated / max(1u, nbPoints) << endl;
+	return 0;
+}
@@ -0,0 +1,101 @@
+#include "tests.h"
+
+#include <iostream>
+#include <opencv2\opencv.hpp>
+#include <vector>
+#include <map>
+
+#include "Octree.h"
+
+using namespace std;
+using namespace cv;
+
+// octree of random points, half of them in a small cluster, against its definition :
+// the leaves tile the box, hold at most leafCapacity points (unless at the maximum depth) but their parent more,
+// every point is in the one leaf containing its position, and the leaves sharing a face with positive area
+// (found by comparing every pair of leaves) are the adjacent ones, with the area of that face
+int OctreeTest(int argc, char* argv[]) {
+
+	RNG rng(1);
+	Mesh mesh;
+	mesh.points.resize(2000);
+	for (uint p = 0; p < mesh.points.size(); p++) {
+		float spread = p % 2 == 0 ? 1.f : 0.01f;
+		mesh.points[p].pos = { rng.uniform(0.f, spread), rng.uniform(0.f, spread), rng.uniform(0.f, 2 * spread) };
+	}
+	Octree tree(mesh, 8, 4);
+	tree.computeAdjacency();
+
+	uint errors = 0;
+
+	// tiling and capacity
+	for (uint i = 0; i < tree.size(); i++) {
+		const Octree::Leaf& leaf = tree.leaves[i];
+		uint64_t end = leaf.code + tree.cellSize(leaf.level);
+		if ((i == 0 && leaf.code != 0) || end != (i + 1 < tree.size() ? tree.leaves[i + 1].code : tree.cellSize(0))) { errors++; }
+		if (leaf.level < tree.maxDepth && tree.nbPoints(i) > tree.leafCapacity) { errors++; }
+		if (leaf.level > 0) {
+			uint64_t parentSize = tree.cellSize(leaf.level - 1);
+			uint64_t parent = leaf.code / parentSize * parentSize;
+			uint first = tree.findLeaf(parent), last = tree.findLeaf(parent + parentSize - 1);
+			if (tree.pointStart[last + 1] - tree.pointStart[first] <= tree.leafCapacity) { errors++; }
+		}
+	}
+
+	// points
+	vector<int> owner(mesh.points.size(), -1);
+	for (uint i = 0; i < tree.size(); i++) {
+		for (uint k = tree.pointStart[i]; k < tree.pointStart[i + 1]; k++) {
+			uint p = tree.pointIndices[k];
+			if (owner[p] != -1) { errors++; }
+			owner[p] = i;
+		}
+	}
+	for (uint p = 0; p < mesh.points.size(); p++) {
+		Octree::Point pos = Octree::position(mesh.points[p].pos);
+		if (owner[p] < 0 || tree.findLeaf(pos) != (uint)owner[p]) { errors++; continue; }
+		Octree::Point corner = tree.corner(owner[p]), extent = tree.cellExtent(tree.leaves[owner[p]].level);
+		for (uint d = 0; d < 3; d++) {
+			float margin = 1e-5f * tree.extent[d];
+			if (pos[d] < corner[d] - margin || pos[d] > corner[d] + extent[d] + margin) { errors++; }
+		}
+	}
+
+	// adjacency, in cells of the deepest level
+	map<pair<uint, uint>, float> expected, found;
+	float cellSide[3];
+	for (uint d = 0; d < 3; d++) { cellSide[d] = tree.extent[d] / (1u << tree.maxDepth); }
+	for (uint i = 0; i < tree.size(); i++) {
+		Octree::Cell a = Octree::decode(tree.leaves[i].code);
+		int64_t sa = 1ll << (tree.maxDepth - tree.leaves[i].level);
+		for (uint j = i + 1; j < tree.size(); j++) {
+			Octree::Cell b = Octree::decode(tree.leaves[j].code);
+			int64_t sb = 1ll << (tree.maxDepth - tree.leaves[j].level);
+			for (uint d = 0; d < 3; d++) {
+				if (a[d] + sa != b[d] && b[d] + sb != a[d]) { continue; }
+				float area = 1;
+				for (uint e = 0; e < 3; e++) {
+					if (e == d) { continue; }
+					int64_t overlap = std::min(a[e] + sa, b[e] + sb) - std::max<int64_t>(a[e], b[e]);
+					area *= overlap > 0 ? overlap * cellSide[e] : 0;
+				}
+				if (area > 0) { expected[{ i, j }] = expected[{ j, i }] = area; }
+			}
+		}
+	}
+	for (uint i = 0; i < tree.size(); i++) {
+		for (uint k = tree.adjacencyStart[i]; k < tree.adjacencyStart[i + 1]; k++) {
+			found[{ i, tree.adjacency[k] }] = tree.sideSizes[k];
+		}
+	}
+	if (found.size() != expected.size()) { errors++; }
+	for (const auto& side : expected) {
+		auto it = found.find(side.first);
+		if (it == found.end() || abs(it->second - side.second) > 1e-4f * side.second) { errors++; }
+	}
+
+	cout << mesh.points.size() << " points, " << tree.size() << " leaves, " << expected.size() / 2 <<
+		" faces, " << errors << " errors" << endl;
+
+	return errors == 0 ? 0 : 1;
+}
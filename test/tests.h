@@ -2,4 +2,14 @@
 
 #include <iostream>
 
-int SIFTMatchTest(int argc, char* argv[]);
\ No newline at end of file
+int SIFTMatchTest(int argc, char* argv[]);
+int ANNBenchmark(int argc, char* argv[]);
+int CompactDescriptorsBenchmark(int argc, char* argv[]);
+int MatcherBenchmark(int argc, char* argv[]);
+int VocabularyTreeTest(int argc, char* argv[]);
+int VideoPipelineTest(int argc, char* argv[]);
+int SIFTAllocationTest(int argc, char* argv[]);
+int FixedPointAccuracyTest(int argc, char* argv[]);
+int PoissonBenchmark(int argc, char* argv[]);
+int TiledPoissonTest(int argc, char* argv[]);
+int OctreeTest(int argc, char* argv[]);